@@ -0,0 +1,188 @@
+// Compares the paged B+tree Index with the boost::interprocess red-black tree
+// it replaced, on the operations the sync thread and readers use. 8 and 16
+// byte keys also go through the fixed width Index.
+//
+//   make bench_index && engine_race/bench_index [keys] [key length]
+#include "engine_race.h"
+#include <random>
+#include <algorithm>
+
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/containers/map.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+
+using namespace polar_race;
+using namespace std;
+
+namespace bip = boost::interprocess;
+
+// The previous fixed-size key and Index, kept here only as a baseline
+struct OldIndexKey {
+  size_t len;
+  char key[MAX_KEY_LEN];
+
+  OldIndexKey(const PolarString &ps) {
+    len = ps.size();
+    memcpy(key, ps.data(), len);
+  }
+
+  bool operator<(const OldIndexKey &ano) const {
+    return PolarString(key, len).compare(PolarString(ano.key, ano.len)) < 0;
+  }
+};
+
+class OldIndex {
+  typedef bip::managed_mapped_file::segment_manager seg_manager;
+  typedef bip::allocator<void, seg_manager> void_alloc;
+  typedef pair<const OldIndexKey, IndexValue> index_map_type;
+  typedef bip::allocator<index_map_type, seg_manager> index_map_type_alloc;
+  typedef bip::map<OldIndexKey, IndexValue, less<OldIndexKey>, index_map_type_alloc> index_map;
+
+  const size_t grow_threshold = 65536 * 16;
+  const size_t grow_chunk = 65536 * 256;
+
+  public:
+    explicit OldIndex(const string &path) : file_path(path) {
+      reload_file();
+    }
+
+    ~OldIndex() {
+      file->flush();
+      delete file;
+    }
+
+    void lossy_put(const PolarString &key, const IndexValue &val) {
+      (*map)[OldIndexKey(key)] = val;
+    }
+
+    void persist() {
+      file->flush();
+    }
+
+    void check_free_space() {
+      if(file->get_segment_manager()->get_free_memory() < grow_threshold) {
+        file->flush();
+        delete file;
+        bip::managed_mapped_file::grow(file_path.c_str(), grow_chunk);
+        reload_file();
+      }
+    }
+
+    optional<IndexValue> get(const PolarString &key) {
+      auto it = map->find(OldIndexKey(key));
+      if(it == map->end()) return {};
+      return { it->second };
+    }
+
+    size_t scan() {
+      size_t n = 0;
+      for(auto it = map->begin(); it != map->end(); ++it)
+        n += it->second.len;
+      return n;
+    }
+
+  private:
+    void reload_file() {
+      try {
+        auto size = fs::file_size(file_path);
+        file = new bip::managed_mapped_file(bip::open_or_create, file_path.c_str(), size);
+      } catch(...) {
+        file = new bip::managed_mapped_file(bip::open_or_create, file_path.c_str(), grow_chunk * 4);
+      }
+
+      void_alloc alloc(file->get_segment_manager());
+      map = file->find_or_construct<index_map>("index")(less<OldIndexKey>(), alloc);
+    }
+
+    string file_path;
+    bip::managed_mapped_file *file;
+    index_map *map;
+};
+
+// The old index only checked for free space between batches of this size
+const size_t BATCH = 128;
+
+static double since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+template<typename I, typename S>
+static void run(const char *name, I &index, const vector<string> &keys, const vector<string> &probes, S scan) {
+  // Same batching as the sync thread: check space, apply a batch, persist
+  auto start = chrono::steady_clock::now();
+  for(size_t i = 0; i<keys.size(); ++i) {
+    if(i % BATCH == 0) {
+      if(i) index.persist();
+      index.check_free_space();
+    }
+    index.lossy_put(IndexKey(keys[i]), IndexValue { i, i, 1 });
+  }
+  index.persist();
+  double put = since(start);
+
+  start = chrono::steady_clock::now();
+  size_t found = 0;
+  for(const auto &key : probes)
+    if(index.get(key)) ++found;
+  double get = since(start);
+
+  start = chrono::steady_clock::now();
+  size_t sum = scan();
+  double range = since(start);
+
+  cout<<name<<": lossy_put "<<keys.size() / put<<" ops/s, get "<<probes.size() / get
+    <<" ops/s ("<<found<<" found), full scan "<<range<<"s ("<<sum<<")"<<endl;
+}
+
+template<typename K>
+static void bench_btree(const char *name, const string &path, const vector<string> &keys, const vector<string> &probes) {
+  Index<K> index(path);
+  run(name, index, keys, probes, [&]() {
+    size_t n = 0;
+    for(typename Index<K>::Cursor it(index, ""); it.valid(); it.next())
+      n += it.value().len;
+    return n;
+  });
+
+  auto flushes = index.flush_stats();
+  cout<<"  "<<flushes.persists<<" persists, "<<flushes.bytes / max<uint64_t>(flushes.persists, 1)
+    <<" bytes and "<<flushes.nanos / 1000 / max<uint64_t>(flushes.persists, 1)<<" us each"<<endl;
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? stoul(argv[1]) : 1000000;
+  size_t keylen = argc > 2 ? stoul(argv[2]) : 16;
+
+  mt19937_64 rng(0);
+  vector<string> keys(count);
+  for(auto &key : keys) {
+    key.resize(keylen);
+    for(auto &c : key) c = 'a' + rng() % 26;
+  }
+
+  vector<string> probes(keys);
+  shuffle(probes.begin(), probes.end(), rng);
+
+  fs::remove("bench_index.old");
+  fs::remove("bench_index.new");
+  fs::remove("bench_index.fixed");
+
+  {
+    OldIndex index("bench_index.old");
+    run("bip::map", index, keys, probes, [&]() { return index.scan(); });
+  }
+
+  bench_btree<VarKey>("B+tree  ", "bench_index.new", keys, probes);
+  if(keylen == 8) bench_btree<FixedKey<8>>("B+tree/8 ", "bench_index.fixed", keys, probes);
+  if(keylen == 16) bench_btree<FixedKey<16>>("B+tree/16", "bench_index.fixed", keys, probes);
+
+  cout<<"File size: bip::map "<<fs::file_size("bench_index.old")
+    <<", B+tree "<<fs::file_size("bench_index.new");
+  if(fs::exists("bench_index.fixed"))
+    cout<<", fixed B+tree "<<fs::file_size("bench_index.fixed");
+  cout<<endl;
+
+  fs::remove("bench_index.old");
+  fs::remove("bench_index.new");
+  fs::remove("bench_index.fixed");
+}
@@ -0,0 +1,88 @@
+// Time Engine::Open takes with the MANIFEST, and with the directory scan it
+// falls back to without one, as the store gets more segments and the index
+// more keys. Sealed segments are sparse files, only their number matters.
+//
+//   make bench_open && engine_race/bench_open [max segments] [max keys] [opens]
+#include "engine_race.h"
+#include <algorithm>
+
+using namespace polar_race;
+using namespace std;
+
+static const string DIR = "bench_open.db";
+
+static double since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Engine logging goes to cout, keep it out of the results
+static Engine* open_quiet() {
+  auto buf = cout.rdbuf(nullptr);
+  Engine *engine;
+  Engine::Open(DIR, &engine);
+  cout.rdbuf(buf);
+  cout.clear();
+  return engine;
+}
+
+static void close_quiet(Engine *engine) {
+  auto buf = cout.rdbuf(nullptr);
+  delete engine;
+  cout.rdbuf(buf);
+  cout.clear();
+}
+
+static void prepare(size_t segments, size_t keys) {
+  fs::remove_all(DIR);
+  fs::create_directories(DIR + "/" + STORE_DIRECTORY);
+  for(size_t i = 0; i + 1<segments; ++i) {
+    string path = DIR + "/" + STORE_DIRECTORY + "/" + to_string(i);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(ftruncate(fd, STORE_MAX_FILESIZE) != 0) perror("ftruncate");
+    ::close(fd);
+  }
+
+  // The values go to the last segment
+  Engine *engine = open_quiet();
+  string value(INLINE_MAX + 1, 'v');
+  WriteBatch batch;
+  for(size_t i = 0; i<keys; ++i) {
+    batch.Put("key" + to_string(i), value);
+    if(batch.Count() == 1000 || i + 1 == keys) {
+      engine->Write(batch);
+      batch.Clear();
+    }
+  }
+  close_quiet(engine);
+}
+
+static double time_open(size_t opens, bool manifest) {
+  double total = 0;
+  for(size_t i = 0; i<opens; ++i) {
+    if(!manifest)
+      fs::remove(DIR + "/" + MANIFEST_FILE);
+    auto start = chrono::steady_clock::now();
+    Engine *engine = open_quiet();
+    total += since(start);
+    close_quiet(engine);
+  }
+  return total / opens;
+}
+
+int main(int argc, char **argv) {
+  size_t max_segments = argc > 1 ? stoul(argv[1]) : 4096;
+  size_t max_keys = argc > 2 ? stoul(argv[2]) : 100000;
+  size_t opens = argc > 3 ? stoul(argv[3]) : 5;
+
+  for(size_t segments = 16; segments <= max_segments; segments *= 16) {
+    for(size_t keys = 1000; keys <= max_keys; keys *= 10) {
+      prepare(segments, keys);
+      double with = time_open(opens, true);
+      double without = time_open(opens, false);
+      cout<<segments<<" segments, "<<keys<<" keys: open "<<with * 1000<<" ms, without MANIFEST "
+        <<without * 1000<<" ms"<<endl;
+    }
+  }
+
+  fs::remove_all(DIR);
+}
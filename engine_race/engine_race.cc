@@ -1,351 +1,3136 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #include "engine_race.h"
+#include <map>
 #include <mutex>
 #include <shared_mutex>
 #include <iostream>
+#include <algorithm>
 
 namespace polar_race {
-  bool Journal::restore() {
+  static uint32_t crc32c(const char *data, size_t len) {
+    static const auto table = [] {
+      std::array<uint32_t, 256> t;
+      for(uint32_t i = 0; i<256; ++i) {
+        uint32_t c = i;
+        for(int k = 0; k<8; ++k)
+          c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        t[i] = c;
+      }
+      return t;
+    }();
+
+    uint32_t crc = ~0u;
+    for(size_t i = 0; i<len; ++i)
+      crc = table[(crc ^ (uint8_t) data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  static void put_varint(std::string &buf, uint64_t v) {
+    while(v >= 0x80) {
+      buf.push_back((char) (v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back((char) v);
+  }
+
+  static bool get_varint(const char *&ptr, const char *end, uint64_t &v) {
+    v = 0;
+    for(int shift = 0; shift < 64 && ptr < end; shift += 7) {
+      uint8_t byte = *ptr++;
+      v |= (uint64_t) (byte & 0x7f) << shift;
+      if(!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  template<typename K>
+  static void encode_entry(std::string &buf, const PolarString &key, const IndexValue &val) {
+    if constexpr(K::width == 0)
+      put_varint(buf, key.size());
+    buf.append(key.data(), key.size());
+    put_varint(buf, val.file);
+    put_varint(buf, val.offset);
+    put_varint(buf, val.len);
+    if(val.is_inline())
+      buf.append(*val.data);
+  }
+
+  // At most what encode_entry adds for the entry
+  static size_t entry_bound(const PolarString &key, const IndexValue &val) {
+    return key.size() + JOURNAL_ENTRY_OVERHEAD + (val.is_inline() ? val.len : 0);
+  }
+
+  // `key` points into the buffer
+  template<typename K>
+  static bool decode_entry(const char *&ptr, const char *end, PolarString &key, IndexValue &val) {
+    uint64_t keylen = K::width;
+    if constexpr(K::width == 0) {
+      if(!get_varint(ptr, end, keylen) || keylen > MAX_KEY_LEN) return false;
+    }
+    if(keylen > (uint64_t) (end - ptr)) return false;
+    key = PolarString(ptr, keylen);
+    ptr += keylen;
+
+    uint64_t file, offset, len;
+    if(!get_varint(ptr, end, file) || !get_varint(ptr, end, offset) || !get_varint(ptr, end, len))
+      return false;
+    val = IndexValue { .file = file, .offset = offset, .len = len };
+    if(val.is_inline()) {
+      if(len > (uint64_t) (end - ptr)) return false;
+      val.data = std::make_shared<const std::string>(ptr, len);
+      ptr += len;
+    }
+    return true;
+  }
+
+  void Manifest::load() {
+    // The newer of the two slots
+    for(size_t slot = 0; slot < 2; ++slot) {
+      ManifestRecord rec;
+      if(pread(fd, &rec, sizeof(rec), slot * MANIFEST_SLOT) != sizeof(rec)) continue;
+      if(rec.magic != MANIFEST_MAGIC) continue;
+      if(rec.crc != crc32c((const char*) &rec + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc))) continue;
+      if(record && rec.gen < record->gen) continue;
+
+      record = rec;
+      gen = rec.gen + 1;
+    }
+  }
+
+  bool Manifest::save(const StoreTail &store, const StoreTail &blobs, uint64_t applied) {
+    ManifestRecord rec {
+      .crc = 0,
+      .magic = MANIFEST_MAGIC,
+      .gen = gen,
+      .store = store,
+      .blobs = blobs,
+      .applied_seq = applied,
+    };
+    rec.crc = crc32c((const char*) &rec + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc));
+
+    // The other slot keeps the previous record until this one is on the disk
+    size_t slot = gen & 1;
+    if(pwrite(fd, &rec, sizeof(rec), slot * MANIFEST_SLOT) != sizeof(rec) || fdatasync(fd) != 0)
+      return false;
+    ++gen;
+    record = rec;
+    return true;
+  }
+
+  static bool header_valid(const JournalHeader &hdr) {
+    return hdr.magic == JOURNAL_MAGIC
+      && hdr.crc == crc32c((const char*) &hdr + sizeof(hdr.crc), sizeof(hdr) - sizeof(hdr.crc))
+      && hdr.offset >= JOURNAL_SECTOR && hdr.offset <= JOURNAL_RING_SIZE;
+  }
+
+  // Until its first header is written, a journal is all zeros. Frames only
+  // follow that header, so anything else in a journal without one was
+  // written by another format
+  template<typename K>
+  bool Journal<K>::formatted(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return true;
+
+    std::string sector(JOURNAL_SECTOR, '\0');
+    ssize_t got = pread(fd, sector.data(), sector.size(), 0);
+    ::close(fd);
+    if(got <= 0) return true;
+
+    for(size_t slot = 0; slot < 2; ++slot) {
+      JournalHeader hdr;
+      if((size_t) got < slot * JOURNAL_HEADER_SLOT + sizeof(hdr)) continue;
+      memcpy(&hdr, sector.data() + slot * JOURNAL_HEADER_SLOT, sizeof(hdr));
+      if(header_valid(hdr)) return true;
+    }
+    return std::all_of(sector.begin(), sector.begin() + got, [](char c) { return c == 0; });
+  }
+
+  template<typename K>
+  bool Journal<K>::restore() {
     std::unique_lock<std::shared_mutex> lock(mut);
-    std::fseek(fd, 0, SEEK_SET);
-    auto entries_mem = new char[sizeof(JournalEntry) * max_size];
-    auto entries = (JournalEntry*) entries_mem;
 
-    size_t count = std::fread(entries, sizeof(JournalEntry), max_size, fd);
+    // Pick the newer of the two header slots
+    bool found = false;
+    for(size_t slot = 0; slot < 2; ++slot) {
+      JournalHeader hdr;
+      if(pread(fd, &hdr, sizeof(hdr), slot * JOURNAL_HEADER_SLOT) != sizeof(hdr)) continue;
+      if(!header_valid(hdr)) continue;
+      if(found && hdr.seq < tail_seq) continue;
+
+      found = true;
+      tail = hdr.offset;
+      tail_seq = hdr.seq;
+      header_gen = slot + 1;
+    }
 
-    if(count < max_size) {
-      ent_counter = count;
-      ent_ident = count;
-    } else {
-      ent_counter = 0;
-      ent_ident = 0;
-      for(size_t i = 1; i<count; ++i) {
-        if(entries[i].ident != (entries[i-1].ident + 1) % (max_size + 1)) {
-          ent_counter = i;
-          ent_ident = (entries[i-1].ident + 1) % (max_size + 1);
-          break;
-        }
-      }
+    if(!found) {
+      // Fresh journal, the header has to be there before any frame. Sequence
+      // numbers go on from the manifest, which skips everything up to `applied`
+      tail_seq = next_seq = pending_seq = framed_seq = frozen_first = applied + 1;
+      flushed = applied;
+      return write_header(JOURNAL_SECTOR, tail_seq);
     }
 
-    if(count < max_size) {
-      for(int i = 0; i<count; ++i) {
-        const auto &ent = entries[i];
-        // std::cout<<"Restored: "<<ent.ident<<" "<<PolarString(ent.key, ent.keylen).ToString()<<std::endl;
-        queue.push_back(ent.pair);
+    head = tail;
+    next_seq = tail_seq;
+
+    // Walk the frames from the checkpoint for as long as the sequence numbers
+    // continue and the checksums match. A frame that does not fit at the end of
+    // the ring is written at its beginning instead
+    std::string buf;
+    auto read_frame = [&](size_t at, JournalFrame &frame) {
+      if(at + sizeof(frame) > JOURNAL_RING_SIZE) return false;
+      if(pread(fd, &frame, sizeof(frame), at) != sizeof(frame)) return false;
+      if(frame.seq != next_seq || frame.count == 0) return false;
+      if(at + sizeof(frame) + frame.size > JOURNAL_RING_SIZE) return false;
+
+      buf.resize(sizeof(frame) + frame.size);
+      if(pread(fd, buf.data(), buf.size(), at) != (ssize_t) buf.size()) return false;
+      return frame.crc == crc32c(buf.data() + sizeof(frame.crc), buf.size() - sizeof(frame.crc));
+    };
+
+    while(true) {
+      JournalFrame frame;
+      size_t at = head;
+      if(!read_frame(at, frame)) {
+        if(at == JOURNAL_SECTOR) break;
+        at = JOURNAL_SECTOR;
+        if(!read_frame(at, frame)) break;
       }
-    } else {
-      size_t iter = ent_counter;
-      while(true) {
-        const auto &ent = entries[iter];
-        // std::cout<<"Restored: "<<ent.ident<<" "<<PolarString(ent.key, ent.keylen).ToString()<<std::endl;
-        queue.push_back(ent.pair);
-        ++iter;
-        if(iter == max_size) iter = 0;
-        if(iter == ent_counter) break;
+
+      const char *ptr = buf.data() + sizeof(frame);
+      const char *end = buf.data() + buf.size();
+      for(uint32_t i = 0; i<frame.count; ++i) {
+        PolarString key;
+        IndexValue val;
+        // The checksum matched, so this is a bug rather than a torn write
+        if(!decode_entry<K>(ptr, end, key, val)) return false;
+        // std::cout<<"Restored: "<<frame.seq + i<<" "<<key.ToString()<<std::endl;
+        // The frame still holds the ring, but the index has the entry
+        if(frame.seq + i > applied)
+          track(Entry(key, val));
       }
+      if(frame.seq + frame.count - 1 > applied)
+        queued_bytes += buf.size();
+
+      frames.push_back({ at, at + buf.size(), frame.seq, frame.seq + frame.count - 1 });
+      head = at + buf.size();
+      next_seq += frame.count;
     }
 
-    // std::cout<<"Seeking..."<<std::endl;
-    if(count < max_size)
-      std::fseek(fd, 0, SEEK_END);
+    pending_seq = framed_seq = next_seq;
+    flushed = next_seq - 1;
+    return true;
+  }
+
+  template<typename K>
+  bool Journal<K>::push(const Entry &pair) {
+    std::unique_lock<std::shared_mutex> lock(mut);
+    if(!make_room(lock, 1, entry_bound(pair.first, pair.second))) return false;
+    return append(lock, &pair, 1);
+  }
+
+  template<typename K>
+  bool Journal<K>::push(const std::vector<Entry> &group) {
+    if(group.empty()) return true;
+
+    size_t bytes = 0;
+    for(const auto &pair : group)
+      bytes += entry_bound(pair.first, pair.second);
+
+    std::unique_lock<std::shared_mutex> lock(mut);
+    if(!make_room(lock, group.size(), bytes)) return false;
+    return append(lock, group.data(), group.size());
+  }
+
+  template<typename K>
+  template<typename F>
+  bool Journal<K>::push_if(const Entry &pair, const IndexValue &expected, F indexed) {
+    std::unique_lock<std::shared_mutex> lock(mut);
+    if(!make_room(lock, 1, entry_bound(pair.first, pair.second))) return false;
+
+    // A key in neither queue is not in the frozen one the sync thread may be
+    // applying, and no other queue can be frozen while we hold the lock. So
+    // its index entry cannot change under the lookup
+    PolarString key = pair.first;
+    std::string_view k(key.data(), key.size());
+    std::optional<IndexValue> current;
+    Table *frozen_in = frozen_table.load(std::memory_order_relaxed);
+    if(auto found = active_table.load(std::memory_order_relaxed)->find(k))
+      current = found->second;
+    else if(auto found = frozen_in ? frozen_in->find(k) : nullptr)
+      current = found->second;
     else
-      std::fseek(fd, sizeof(JournalEntry) * ent_counter, SEEK_SET);
-    // std::cout<<"Seeked."<<std::endl;
+      current = indexed();
+    if(!current || current->file != expected.file || current->offset != expected.offset)
+      return false;
+
+    return append(lock, &pair, 1);
+  }
+
+  template<typename K>
+  bool Journal<K>::make_room(std::unique_lock<std::shared_mutex> &lock, size_t count, size_t bytes) {
+    // Journal is rarely full, so we are checking for that inside. A group
+    // larger than the whole queue goes in once it is empty. Everything not
+    // yet applied has to fit the ring too, or a leader could wait for ring
+    // space that only the sync thread frees, while the sync thread waits for
+    // the leader's flush
+    bytes += sizeof(JournalFrame);
+    auto over = [&]() { return queued_bytes + frozen_bytes + bytes > JOURNAL_QUEUE_BYTES; };
+    while(!io_failed && (queue.size() + count > capacity - backoff || over())) {
+      request_sync();
+
+      if((!queue.empty() && queue.size() + count > capacity)
+          || ((!queue.empty() || !frozen.empty()) && over())) {
+        stalled = true;
+        wait_room(lock);
+      } else {
+        break;
+      }
+    }
+    return !io_failed;
+  }
 
-    // Don't drop buf, as it needs to be persisted in the queue
+  // Busy waits up to JOURNAL_SPIN for `done`. Not worth it on a single CPU,
+  // where whoever we wait for cannot run meanwhile
+  template<typename F>
+  static bool spin_until(F done) {
+    static const bool spin = std::thread::hardware_concurrency() > 1;
+    if(!spin) return done();
+
+    auto until = std::chrono::steady_clock::now() + JOURNAL_SPIN;
+    while(!done()) {
+      if(std::chrono::steady_clock::now() >= until) return false;
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    }
     return true;
   }
 
-  bool Journal::push(const std::pair<IndexKey, IndexValue> &pair) {
-    // Journal is rarely full, so we are checking for that inside
-    std::unique_lock<std::shared_mutex> lock(mut);
-    while(queue.size() >= max_size - JOURNAL_BACKOFF) {
+  template<typename K>
+  void Journal<K>::wait_room(std::unique_lock<std::shared_mutex> &lock) {
+    ++counters.stalls;
+    uint64_t seen = room.load(std::memory_order_acquire);
+    lock.unlock();
+    bool moved = spin_until([&]() { return room.load(std::memory_order_acquire) != seen; });
+    lock.lock();
+    if(moved || room.load(std::memory_order_relaxed) != seen) return;
+
+    // Whoever makes room bumps it under the lock we hold, so it sees us parked
+    ++counters.parks;
+    ++parked_writers;
+    notify_writers.wait_for(lock, WRITER_WAIT_TIMEOUT);
+    --parked_writers;
+  }
+
+  // Both under the lock
+  template<typename K>
+  void Journal<K>::request_sync() {
+    if(sync_wanted.load(std::memory_order_relaxed)) return;
+    sync_wanted.store(true, std::memory_order_release);
+    if(sync_parked)
       notify_sync.notify_one();
+  }
 
-      if(queue.size() == max_size) {
-        notify_writers.wait_for(lock, WRITER_WAIT_TIMEOUT);
-      } else {
+  template<typename K>
+  void Journal<K>::wake_writers() {
+    room.fetch_add(1, std::memory_order_release);
+    if(parked_writers > 0)
+      notify_writers.notify_all();
+  }
+
+  template<typename K>
+  void Journal<K>::resize(size_t handed) {
+    // Writers waited: larger queues, so each index persist covers more of them.
+    // Mostly empty for a while: smaller ones, which stay in the CPU caches
+    if(stalled) {
+      capacity = std::min(capacity * 2, JOURNAL_MAX_SIZE);
+      quiet_rounds = 0;
+    } else if(handed < capacity / 4) {
+      if(++quiet_rounds >= JOURNAL_SHRINK_ROUNDS) {
+        capacity = std::max(capacity / 2, JOURNAL_MIN_SIZE);
+        quiet_rounds = 0;
+      }
+    } else {
+      quiet_rounds = 0;
+    }
+    stalled = false;
+
+    // Wake the sync thread while there is still room for what comes in while
+    // it applies the queue, with a margin for bursts
+    size_t expected = (size_t) (write_rate * sync_latency * 2);
+    backoff = std::clamp(expected, capacity / 8, capacity / 2);
+  }
+
+  template<typename K>
+  bool Journal<K>::append(std::unique_lock<std::shared_mutex> &lock, const Entry *entries, size_t count) {
+    if(pending.empty())
+      pending_seq = next_seq;
+
+    size_t before = pending.size();
+    for(size_t i = 0; i<count; ++i) {
+      track(entries[i]);
+      encode_entry<K>(pending, entries[i].first, entries[i].second);
+      const IndexValue &val = entries[i].second;
+      if(!val.is_inline() && std::find(pending_files.begin(), pending_files.end(), val.file) == pending_files.end())
+        pending_files.push_back(val.file);
+    }
+    queued_bytes += pending.size() - before + sizeof(JournalFrame);
+
+    next_seq += count;
+    uint64_t last = next_seq - 1;
+    pending_groups.emplace_back(pending.size(), last);
+
+    return commit(lock, last);
+  }
+
+  template<typename K>
+  bool Journal<K>::commit(std::unique_lock<std::shared_mutex> &lock, uint64_t ticket) {
+    while(flushed < ticket && !io_failed) {
+      if(flushing) {
+        // Someone else is leading a flush, our entry goes with the next one
+        notify_flushed.wait(lock);
+        continue;
+      }
+
+      flushing = true;
+      std::string batch;
+      batch.swap(pending);
+      auto groups = std::move(pending_groups);
+      pending_groups.clear();
+      auto files = std::move(pending_files);
+      pending_files.clear();
+      uint64_t seq = pending_seq;
+
+      // Cut the batch into frames of whole groups, and find room for them in the ring
+      std::vector<std::pair<size_t, std::string>> writes;
+      size_t begin = 0;
+      for(size_t i = 0; i<groups.size(); ) {
+        auto [end, last] = groups[i++];
+        while(i < groups.size() && groups[i].first - begin <= JOURNAL_FRAME_LIMIT)
+          std::tie(end, last) = groups[i++];
+
+        JournalFrame frame {
+          .crc = 0,
+          .size = (uint32_t) (end - begin),
+          .seq = seq,
+          .count = (uint32_t) (last - seq + 1),
+          .reserved = 0,
+        };
+
+        std::string buf(sizeof(frame) + frame.size, '\0');
+        memcpy(buf.data(), &frame, sizeof(frame));
+        memcpy(buf.data() + sizeof(frame), batch.data() + begin, frame.size);
+        frame.crc = crc32c(buf.data() + sizeof(frame.crc), buf.size() - sizeof(frame.crc));
+        memcpy(buf.data(), &frame.crc, sizeof(frame.crc));
+
+        size_t at;
+        while(!io_failed && !reserve(buf.size(), at)) {
+          // Ring is full of unapplied entries, wait for the sync to move the tail
+          request_sync();
+          wait_room(lock);
+        }
+        if(io_failed) break;
+
+        frames.push_back({ at, at + buf.size(), seq, last });
+        framed_seq = last + 1;
+        writes.emplace_back(at, std::move(buf));
+
+        begin = end;
+        seq = last + 1;
+      }
+
+      // The sync thread stopped, and the ring may never get room
+      if(io_failed) {
+        flushing = false;
+        discard();
+        notify_flushed.notify_all();
         break;
       }
+
+      // Writers keep queueing up behind us while we are on the disk. The
+      // values go first, an entry must not survive a crash without its value
+      lock.unlock();
+      bool ok = true;
+      for(size_t file : files)
+        ok = ok && (!sync_file || sync_file(file));
+      for(const auto &[at, buf] : writes)
+        ok = ok && pwrite(fd, buf.data(), buf.size(), at) == (ssize_t) buf.size();
+      ok = ok && fdatasync(fd) == 0;
+      lock.lock();
+
+      // A failed batch is not flushed, and neither is anything behind it
+      if(ok)
+        flushed = seq - 1;
+      else
+        io_failed = true;
+      flushing = false;
+      if(io_failed) discard();
+      notify_flushed.notify_all();
     }
 
-    queue.push_back(pair);
+    return flushed >= ticket;
+  }
 
-    JournalEntry ent {
-      .ident = (size_t) ent_ident,
-      .pair = pair,
+  // Under the lock, once the journal failed and no flush is under way
+  template<typename K>
+  void Journal<K>::discard() {
+    pending.clear();
+    pending_groups.clear();
+    pending_files.clear();
+    // Frames of the failed batch stay behind head, recovery starts after them
+    // once the next checkpoint writes the header
+    while(!frames.empty() && frames.back().last_seq > flushed)
+      frames.pop_back();
+    framed_seq = flushed + 1;
+
+    // The newest entries are in the active queue, then the frozen one
+    size_t unflushed = next_seq - 1 - flushed;
+    if(unflushed == 0) return;
+    auto drop = [&](Queue &from, std::atomic<Table*> &table, size_t count) {
+      Queue kept(from.begin(), from.end() - count);
+      Table *replacement = new_table(kept.size());
+      for(const auto &entry : kept)
+        replacement->insert(&entry);
+      retired.emplace_back(table.exchange(replacement));
+      // Readers may still be in the old entries
+      dropped.push_back(std::move(from));
+      from = std::move(kept);
     };
+    size_t from_queue = std::min(unflushed, queue.size());
+    drop(queue, active_table, from_queue);
+    if(unflushed > from_queue)
+      drop(frozen, frozen_table, unflushed - from_queue);
+    next_seq = flushed + 1;
+  }
 
-    if(++ent_ident == max_size + 1)
-      ent_ident = 0;
-    
-    // Write
-    // We don't care about endian, because we are running on the same computer
-    std::fwrite(&ent, sizeof(JournalEntry), 1, fd);
-    std::fflush(fd);
-    if(++ent_counter == max_size) {
-      ent_counter = 0;
-      std::fseek(fd, 0, SEEK_SET);
+  template<typename K>
+  bool Journal<K>::reserve(size_t size, size_t &at) {
+    // head never catches up with tail from behind, so head == tail means empty
+    if(head >= tail) {
+      if(JOURNAL_RING_SIZE - head >= size) {
+        at = head;
+      } else if(tail - JOURNAL_SECTOR > size) {
+        at = JOURNAL_SECTOR;
+      } else {
+        return false;
+      }
+    } else if(tail - head > size) {
+      at = head;
+    } else {
+      return false;
     }
 
+    head = at + size;
     return true;
   }
 
-  std::deque<std::pair<IndexKey, IndexValue>>* Journal::wait_data(std::unique_lock<std::shared_mutex> &lock) {
-    notify_writers.notify_all();
-    notify_sync.wait_for(lock, SYNC_WAIT_TIMEOUT);
-    return &queue;
+  template<typename K>
+  bool Journal<K>::write_header(size_t offset, uint64_t seq) {
+    JournalHeader hdr {
+      .crc = 0,
+      .magic = JOURNAL_MAGIC,
+      .offset = offset,
+      .seq = seq,
+    };
+    hdr.crc = crc32c((const char*) &hdr + sizeof(hdr.crc), sizeof(hdr) - sizeof(hdr.crc));
+
+    size_t slot = header_gen++ & 1;
+    return pwrite(fd, &hdr, sizeof(hdr), slot * JOURNAL_HEADER_SLOT) == sizeof(hdr)
+      && fdatasync(fd) == 0;
   }
 
-  std::deque<std::pair<IndexKey, IndexValue>>* Journal::data() {
-    return &queue;
+  template<typename K>
+  void Journal<K>::checkpoint() {
+    // The frozen queue is in the persisted index, so the ring space before
+    // the active one can be reused
+    std::unique_lock<std::shared_mutex> lock(mut);
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - handed_at;
+    sync_latency += (took.count() - sync_latency) * JOURNAL_RATE_WEIGHT;
+    // Readers may still be in the entries or the tables, they go once
+    // those are done
+    Queue applied_entries;
+    applied_entries.swap(frozen);
+    std::unique_ptr<Table> applied_table(frozen_table.exchange(nullptr));
+    auto replaced = std::move(retired);
+    retired.clear();
+    bool freed = frozen_bytes > 0;
+    frozen_bytes = 0;
+
+    uint64_t applied = next_seq - 1 - queue.size();
+    while(!frames.empty() && frames.front().last_seq <= applied)
+      frames.pop_front();
+
+    size_t offset = frames.empty() ? head : frames.front().offset;
+    uint64_t seq = frames.empty() ? framed_seq : frames.front().first_seq;
+    // The old tail must stay readable until the new header is on the disk
+    if((offset != tail || seq != tail_seq) && write_header(offset, seq)) {
+      tail = offset;
+      tail_seq = seq;
+      freed = true;
+    }
+    if(freed)
+      wake_writers();
+    lock.unlock();
+    wait_readers();
   }
 
-  std::unique_lock<std::shared_mutex> Journal::lock() {
-    return std::unique_lock(mut);
+  template<typename K>
+  void Journal<K>::fail() {
+    std::unique_lock<std::shared_mutex> lock(mut);
+    io_failed = true;
+    if(!flushing) discard();
+    notify_flushed.notify_all();
+    wake_writers();
   }
 
-  std::shared_lock<std::shared_mutex> Journal::shared_lock() {
-    return std::shared_lock(mut);
+  template<typename K>
+  typename Journal<K>::Queue* Journal<K>::wait_data() {
+    // Under load the next request comes soon after the last one
+    if(sync_spins)
+      spin_until([&]() { return sync_wanted.load(std::memory_order_acquire); });
+
+    std::unique_lock<std::shared_mutex> lock(mut);
+    if(!sync_wanted.load(std::memory_order_relaxed)) {
+      sync_parked = true;
+      notify_sync.wait_for(lock, SYNC_WAIT_TIMEOUT);
+      sync_parked = false;
+    }
+    sync_spins = sync_wanted.exchange(false, std::memory_order_relaxed);
+
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> interval = now - last_swap;
+    if(interval.count() > 0)
+      write_rate += (queue.size() / interval.count() - write_rate) * JOURNAL_RATE_WEIGHT;
+    last_swap = handed_at = now;
+    ++counters.syncs;
+    resize(queue.size());
+
+    // Writers go on with an empty queue, readers still find the frozen one
+    frozen_first = next_seq - queue.size();
+    // A reader that finds the new table finds the frozen one after it
+    frozen.swap(queue);
+    // Sized for as many keys as the last queue had
+    frozen_table.store(active_table.load());
+    active_table.store(new_table(frozen_table.load()->used));
+    frozen_bytes += queued_bytes;
+    queued_bytes = 0;
+    wake_writers();
+
+    // Nothing goes into the index before it is on the disk. Otherwise a crash
+    // could keep part of a group that recovery does not replay. A failed
+    // journal drops what did not make it once the last flush is over
+    uint64_t last = next_seq - 1;
+    notify_flushed.wait(lock, [&]() { return flushed >= last || (io_failed && !flushing); });
+    return &frozen;
+  }
+
+  template<typename K>
+  JournalStats Journal<K>::stats() {
+    std::shared_lock<std::shared_mutex> lock(mut);
+    JournalStats result = counters;
+    result.capacity = capacity;
+    result.backoff = backoff;
+    return result;
   }
 
-  std::optional<IndexValue> Journal::fetch(const PolarString &key) {
+  template<typename K>
+  uint64_t Journal<K>::frozen_seq() {
     std::shared_lock<std::shared_mutex> lock(mut);
-    for(auto it = queue.rbegin(); it != queue.rend(); ++it)
-      if(it->first.equals(key))
-        return it->second;
+    return frozen_first;
+  }
 
-    return {};
+  template<typename K>
+  uint64_t Journal<K>::data_seq() {
+    return next_seq - 1;
   }
 
-  void Index::lossy_put(const IndexKey &key, const IndexValue &val) {
-    (*map)[key] = val;
+  template<typename K>
+  typename Journal<K>::Queue* Journal<K>::data() {
+    return &queue;
+  }
+
+  template<typename K>
+  typename Journal<K>::Queue* Journal<K>::frozen_data() {
+    return &frozen;
+  }
+
+  template<typename K>
+  void Journal<K>::track(const Entry &pair) {
+    queue.push_back(pair);
+    publish(&queue.back());
+  }
+
+  template<typename K>
+  typename Journal<K>::Table* Journal<K>::new_table(size_t keys) {
+    size_t size = JOURNAL_TABLE_MIN;
+    while(size < 2 * keys)
+      size *= 2;
+    return new Table(size);
   }
 
-  void Index::persist() {
-    file->flush();
+  template<typename K>
+  static std::string_view entry_key(const typename Journal<K>::Entry *entry) {
+    PolarString key = entry->first;
+    return std::string_view(key.data(), key.size());
   }
 
-  void Index::check_free_space() {
-    if(file->get_segment_manager()->get_free_memory() < GROW_THRESHOLD) {
-      // std::cout<<"Grow"<<std::endl;
-      file->flush();
-      delete file;
-      bip::managed_mapped_file::grow(file_path.c_str(), GROW_CHUNK);
-      this->reload_file();
+  template<typename K>
+  const typename Journal<K>::Entry* Journal<K>::Table::find(std::string_view key) const {
+    for(size_t i = std::hash<std::string_view>()(key) & mask; ; i = (i + 1) & mask) {
+      const Entry *entry = slots[i].load(std::memory_order_acquire);
+      if(!entry || entry_key<K>(entry) == key) return entry;
     }
   }
 
-  void Index::reload_file() {
-    try {
-      auto size = std::experimental::filesystem::file_size(file_path.c_str());
-      file = new bip::managed_mapped_file(bip::open_or_create, file_path.c_str(), size);
-    } catch(...) {
-      file = new bip::managed_mapped_file(bip::open_or_create, file_path.c_str(), GROW_CHUNK * INDEX_INITIAL_CHUNK);
+  template<typename K>
+  void Journal<K>::Table::insert(const Entry *entry) {
+    std::string_view key = entry_key<K>(entry);
+    size_t i = std::hash<std::string_view>()(key) & mask;
+    while(true) {
+      const Entry *e = slots[i].load(std::memory_order_relaxed);
+      if(!e) ++used;
+      if(!e || entry_key<K>(e) == key) break;
+      i = (i + 1) & mask;
+    }
+    slots[i].store(entry, std::memory_order_release);
+  }
+
+  // Under the lock
+  template<typename K>
+  void Journal<K>::publish(const Entry *entry) {
+    Table *table = active_table.load(std::memory_order_relaxed);
+    if(2 * (table->used + 1) > table->mask + 1) {
+      auto larger = new Table(2 * (table->mask + 1));
+      for(size_t i = 0; i <= table->mask; ++i) {
+        const Entry *e = table->slots[i].load(std::memory_order_relaxed);
+        if(!e) continue;
+        size_t j = std::hash<std::string_view>()(entry_key<K>(e)) & larger->mask;
+        while(larger->slots[j].load(std::memory_order_relaxed))
+          j = (j + 1) & larger->mask;
+        larger->slots[j].store(e, std::memory_order_relaxed);
+      }
+      larger->used = table->used;
+      active_table.store(larger);
+      retired.emplace_back(table);
+      table = larger;
     }
 
-    void_alloc alloc(file->get_segment_manager());
-    map = file->find_or_construct<index_map>("index")(std::less<IndexKey>(), alloc);
+    table->insert(entry);
   }
 
-  std::optional<IndexValue> Index::get(const IndexKey &key) {
-    auto it = map->find(key);
-    if(it == map->end()) return {};
-    return { it->second };
+  template<typename K>
+  static size_t reader_stripe() {
+    static std::atomic<size_t> next = 0;
+    thread_local size_t stripe = next++ % JOURNAL_READER_STRIPES;
+    return stripe;
   }
 
-  std::pair<IndexKey, IndexValue> Store::append(std::pair<PolarString, PolarString> val) {
-    std::unique_lock lock(fs_mut);
+  // The increment comes before the tables are loaded, both sequentially
+  // consistent. A reader that got a table before it was unpublished is
+  // counted by the time wait_readers looks
+  template<typename K>
+  Journal<K>::ReadGuard::ReadGuard(Journal &journal) {
+    auto &stripe = journal.readers[reader_stripe<K>()];
+    count = &stripe.count[journal.reader_epoch.load() & 1];
+    count->fetch_add(1);
+  }
 
-    FILE* fd = get_fd(file_counter, offset);
+  template<typename K>
+  void Journal<K>::wait_readers() {
+    auto drain = [&](size_t parity) {
+      for(auto &stripe : readers)
+        while(stripe.count[parity].load() > 0)
+          std::this_thread::yield();
+    };
 
-    std::fwrite(val.second.data(), sizeof(char), val.second.size(), fd);
+    // New readers only join the current epoch, so the other one drains. Then
+    // the same once they join the other one
+    uint64_t epoch = reader_epoch.load();
+    drain((epoch + 1) & 1);
+    reader_epoch.store(epoch + 1);
+    drain(epoch & 1);
+  }
 
-    IndexValue value = {
-      .file = file_counter,
-      .offset = offset,
-      .len = val.second.size(),
-    };
+  template<typename K>
+  uint64_t Journal<K>::last_seq() {
+    std::shared_lock<std::shared_mutex> lock(mut);
+    return next_seq - 1;
+  }
+
+  template<typename K>
+  uint64_t Journal<K>::applied_seq() {
+    std::shared_lock<std::shared_mutex> lock(mut);
+    return next_seq - 1 - queue.size() - frozen.size();
+  }
+
+  template<typename K>
+  std::shared_lock<std::shared_mutex> Journal<K>::shared_lock() {
+    return std::shared_lock(mut);
+  }
 
-    auto result = std::make_pair(val.first, value);
+  template<typename K>
+  std::optional<IndexValue> Journal<K>::fetch(const PolarString &key) {
+    ReadGuard guard(*this);
+    std::string_view k(key.data(), key.size());
+    if(auto found = active_table.load()->find(k)) return found->second;
 
-    offset += val.second.size();
+    Table *frozen_in = frozen_table.load();
+    if(auto found = frozen_in ? frozen_in->find(k) : nullptr) return found->second;
+    return {};
+  }
 
-    if(offset > STORE_MAX_FILESIZE) {
-      offset = 0;
-      ++file_counter;
-      fclose(fd);
-      fd = get_fd(file_counter, offset);
+  template<typename K>
+  void Journal<K>::fetch_all(const std::vector<PolarString> &keys, std::vector<std::optional<IndexValue>> &locs) {
+    ReadGuard guard(*this);
+    Table *active_in = active_table.load(), *frozen_in = frozen_table.load();
+    locs.assign(keys.size(), {});
+    for(size_t i = 0; i<keys.size(); ++i) {
+      std::string_view k(keys[i].data(), keys[i].size());
+      if(auto found = active_in->find(k))
+        locs[i] = found->second;
+      else if(auto found = frozen_in ? frozen_in->find(k) : nullptr)
+        locs[i] = found->second;
     }
+  }
 
-    std::fclose(fd);
+  static const char* record(const IndexPage *p, size_t i) {
+    return (const char*) p + p->slots()[i];
+  }
 
-    return result;
+  // The key as stored, which is only the part after the page prefix
+  template<typename K>
+  static PolarString record_key(const char *rec) {
+    if constexpr(K::width > 0)
+      return PolarString(rec, K::width);
+
+    uint16_t len;
+    memcpy(&len, rec, sizeof(len));
+    return PolarString(rec + sizeof(len), len);
   }
 
-  template<typename C>
-  std::vector<std::pair<IndexKey, IndexValue>> Store::append(const C &vals) {
-    std::unique_lock lock(fs_mut);
+  template<typename K>
+  static const char* record_payload(const char *rec) {
+    PolarString key = record_key<K>(rec);
+    return key.data() + key.size();
+  }
 
-    FILE* fd = get_fd(file_counter, offset);
-    std::vector<std::pair<IndexKey, IndexValue>> result;
-    result.reserve(vals.size());
+  // Leaf payload
+  static std::string encode_value(const IndexValue &val) {
+    uint64_t fields[3] = { val.file, val.offset, val.len };
+    std::string buf((const char*) fields, sizeof(fields));
+    if(val.is_inline())
+      buf.append(*val.data);
+    return buf;
+  }
 
-    for(const auto &val : vals) {
-      // std::cout<<"[STORE] INSERT: "<<val.second<<std::endl;
-      std::fwrite(val.second.data(), sizeof(char), val.second.size(), fd);
+  // Without the inline bytes
+  static IndexValue decode_fields(const char *payload) {
+    uint64_t fields[3];
+    memcpy(fields, payload, sizeof(fields));
+    return IndexValue { .file = fields[0], .offset = fields[1], .len = fields[2] };
+  }
 
-      IndexValue value = {
-        .file = file_counter,
-        .offset = offset,
-        .len = val.second.size(),
-      };
+  static IndexValue decode_value(const char *payload) {
+    IndexValue val = decode_fields(payload);
+    if(val.is_inline())
+      val.data = std::make_shared<const std::string>(payload + VALUE_FIELDS, val.len);
+    return val;
+  }
 
-      result.emplace_back(val.first, value);
+  static size_t payload_size(uint16_t level, const char *payload) {
+    if(level > 0) return sizeof(uint64_t);
 
-      offset += val.second.size();
+    uint64_t fields[3];
+    memcpy(fields, payload, sizeof(fields));
+    return VALUE_FIELDS + (fields[0] == INLINE_FILE ? fields[2] : 0);
+  }
 
-      if(offset > STORE_MAX_FILESIZE) {
-        offset = 0;
-        ++file_counter;
-        fclose(fd);
-        fd = get_fd(file_counter, offset);
-      }
-      // std::cout<<"[STORE] NOW OFFSET: "<<offset<<std::endl;
-    }
-    std::fclose(fd);
+  template<typename K>
+  static std::string make_record(const PolarString &key, const void *payload, size_t len) {
+    uint16_t keylen = key.size();
+    std::string rec;
+    rec.reserve(sizeof(keylen) + key.size() + len);
+    if constexpr(K::width == 0)
+      rec.append((const char*) &keylen, sizeof(keylen));
+    rec.append(key.data(), key.size());
+    rec.append((const char*) payload, len);
+    return rec;
+  }
 
-    return result;
+  template<typename K>
+  static uint64_t record_child(const char *rec) {
+    uint64_t child;
+    memcpy(&child, record_payload<K>(rec), sizeof(child));
+    return child;
   }
 
-  std::string Store::fetch(const IndexValue &loc) {
-    std::string result(loc.len, '\0');
-    FILE* fd = get_fd(loc.file, loc.offset);
-    fread(result.data(), sizeof(char), loc.len, fd);
-    fclose(fd);
-    return result;
+  static PolarString page_prefix(const IndexPage *p) {
+    return PolarString((const char*) p + INDEX_PAGE_SIZE - p->prefix, p->prefix);
+  }
+
+  template<typename K>
+  static std::string full_key(const IndexPage *p, size_t i) {
+    return page_prefix(p).ToString() + record_key<K>(record(p, i)).ToString();
+  }
+
+  // Record with the full key, as used outside of the page
+  template<typename K>
+  static std::string full_record(const IndexPage *p, size_t i) {
+    const char *rec = record(p, i);
+    const char *payload = record_payload<K>(rec);
+    return make_record<K>(full_key<K>(p, i), payload, payload_size(p->level, payload));
   }
 
-  FILE* Store::get_fd(size_t file, size_t offset) {
-    FILE* result = fopen((basedir + "/" + std::to_string(file)).c_str(), "r+");
-    if(!result)
-      result = fopen((basedir + "/" + std::to_string(file)).c_str(), "w+");
-    fseek(result, offset, SEEK_SET);
+  template<typename K>
+  static std::string strip_prefix(const std::string &rec, size_t prefix) {
+    if constexpr(K::width > 0)
+      return rec;
+
+    PolarString key = record_key<K>(rec.data());
+    PolarString rest(key.data() + prefix, rec.size() - sizeof(uint16_t) - prefix);
+    uint16_t keylen = key.size() - prefix;
+    std::string result((const char*) &keylen, sizeof(keylen));
+    result.append(rest.data(), rest.size());
     return result;
   }
 
-  RetCode Engine::Open(const std::string& name, Engine** eptr) {
-    return EngineRace::Open(name, eptr);
+  static size_t free_space(const IndexPage *p) {
+    return p->heap - sizeof(IndexPage) - p->count * sizeof(uint16_t);
   }
 
-  Engine::~Engine() {}
+  static size_t common_prefix(const PolarString &a, const PolarString &b) {
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while(i < n && a[i] == b[i]) ++i;
+    return i;
+  }
 
-  /*
-   * Complete the functions below to implement you own engine
-   */
+  // Positions the key against the whole page when it does not start with the
+  // prefix: -1 if it is below every key of the page, 1 if above. Otherwise 0,
+  // and `suffix` is what has to be searched for among the records
+  template<typename K>
+  static int against_prefix(const IndexPage *p, const PolarString &key, PolarString &suffix) {
+    if constexpr(K::width > 0) {
+      suffix = key;
+      return 0;
+    }
 
-  // 1. Open engine
-  RetCode EngineRace::Open(const std::string& name, Engine** eptr) {
-    std::experimental::filesystem::create_directory(name);
-    *eptr = NULL;
-    EngineRace *engine_race = new EngineRace(name);
+    PolarString prefix = page_prefix(p);
+    int c = memcmp(key.data(), prefix.data(), std::min(key.size(), prefix.size()));
+    if(c != 0) return c < 0 ? -1 : 1;
+    if(key.size() < prefix.size()) return -1;
 
-    *eptr = engine_race;
-    return kSucc;
+    suffix = PolarString(key.data() + prefix.size(), key.size() - prefix.size());
+    return 0;
   }
 
-  // 3. Write a key-value pair into engine
-  RetCode EngineRace::Write(const PolarString& key, const PolarString& value) {
-    auto pair = store.append({ key, value });
-    journal.push(pair);
-    return kSucc;
+  // First slot whose key is not less than `key`
+  template<typename K>
+  static size_t lower_bound(const IndexPage *p, const PolarString &key) {
+    PolarString suffix;
+    int c = against_prefix<K>(p, key, suffix);
+    if(c != 0) return c < 0 ? 0 : p->count;
+
+    size_t lo = 0, hi = p->count;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(K::compare(record_key<K>(record(p, mid)), suffix) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
   }
 
-  // 4. Read value of a key
-  RetCode EngineRace::Read(const PolarString& key, std::string* value) {
-    auto loc = journal.fetch(key);
+  template<typename K>
+  static bool matches(const IndexPage *p, size_t pos, const PolarString &key) {
+    PolarString suffix;
+    return pos < p->count && against_prefix<K>(p, key, suffix) == 0 && record_key<K>(record(p, pos)) == suffix;
+  }
 
-    if(!loc) {
-      std::shared_lock lock(read_lock);
-      loc = { index.get(key) };
+  template<typename K>
+  static uint64_t child_for(const IndexPage *p, const PolarString &key) {
+    PolarString suffix;
+    int c = against_prefix<K>(p, key, suffix);
+    size_t lo = c > 0 ? p->count : 0, hi = p->count;
+    if(c == 0) {
+      while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(K::compare(record_key<K>(record(p, mid)), suffix) <= 0) lo = mid + 1;
+        else hi = mid;
+      }
     }
+    return lo == 0 ? p->link : record_child<K>(record(p, lo - 1));
+  }
 
-    if(!loc) return kNotFound;
+  // Header invariants. A torn read of a page that passes them only ever
+  // follows offsets into the readable reservation
+  static bool sane(const IndexPage *p) {
+    return p->heap <= INDEX_PAGE_SIZE && p->prefix <= INDEX_PAGE_SIZE - p->heap
+      && sizeof(IndexPage) + p->count * sizeof(uint16_t) <= p->heap;
+  }
 
-    *value = store.fetch(*loc);
-    return kSucc;
+  static void init_page(IndexPage *p, uint16_t level, uint64_t link) {
+    p->level = level;
+    p->count = 0;
+    p->heap = INDEX_PAGE_SIZE;
+    p->prefix = 0;
+    p->link = link;
   }
 
-  /*
-   * NOTICE: Implement 'Range' in quarter-final,
-   *         you can skip it in preliminary.
-   */
-  // 5. Applies the given Vistor::Visit function to the result
-  // of every key-value pair in the key range [first, last),
-  // in order
-  // lower=="" is treated as a key before all keys in the database.
-  // upper=="" is treated as a key after all keys in the database.
-  // Therefore the following call will traverse the entire database:
-  //   Range("", "", visitor)
-  RetCode EngineRace::Range(const PolarString& lower, const PolarString& upper,
-      Visitor &visitor) {
-    std::map<IndexKey, IndexValue> pending;
-    auto journal_lock = journal.shared_lock();
+  // The record bytes stay where they are until the page is rebuilt
+  static void erase(IndexPage *p, size_t pos) {
+    memmove(p->slots() + pos, p->slots() + pos + 1, (p->count - pos - 1) * sizeof(uint16_t));
+    --p->count;
+  }
+
+  // Caller checks free_space
+  static void place(IndexPage *p, size_t pos, const std::string &rec) {
+    p->heap -= rec.size();
+    memcpy((char*) p + p->heap, rec.data(), rec.size());
+    memmove(p->slots() + pos + 1, p->slots() + pos, (p->count - pos) * sizeof(uint16_t));
+    p->slots()[pos] = p->heap;
+    ++p->count;
+  }
+
+  // Bytes a page built out of full records [b, e) takes
+  template<typename K>
+  static size_t shared_prefix(const std::vector<std::string> &recs, size_t b, size_t e) {
+    if(K::width > 0 || b == e) return 0;
+    return common_prefix(record_key<K>(recs[b].data()), record_key<K>(recs[e-1].data()));
+  }
+
+  template<typename K>
+  static size_t packed_size(const std::vector<std::string> &recs, size_t b, size_t e) {
+    size_t prefix = shared_prefix<K>(recs, b, e);
+    size_t bytes = sizeof(IndexPage) + prefix;
+    for(size_t i = b; i<e; ++i)
+      bytes += recs[i].size() - prefix + sizeof(uint16_t);
+    return bytes;
+  }
+
+  template<typename K>
+  static void build_page(IndexPage *p, uint16_t level, uint64_t link,
+      const std::vector<std::string> &recs, size_t b, size_t e) {
+    init_page(p, level, link);
+    if(b == e) return;
 
-    auto data = journal.data();
-    for(const auto &pair : *data)
-      pending[pair.first] = pair.second;
+    // Records are sorted, so the first and the last one bound the shared prefix
+    p->prefix = shared_prefix<K>(recs, b, e);
+    p->heap -= p->prefix;
+    memcpy((char*) p + p->heap, record_key<K>(recs[b].data()).data(), p->prefix);
 
-    journal_lock.unlock();
+    for(size_t i = b; i<e; ++i)
+      place(p, i - b, strip_prefix<K>(recs[i], p->prefix));
+  }
 
-    std::shared_lock lock(read_lock);
+  template<typename K>
+  uint64_t Index<K>::find_leaf(const PolarString &key, std::vector<uint64_t> *path) {
+    uint64_t id = meta()->root;
+    while(page(id)->level > 0) {
+      if(path) path->push_back(id);
+      id = child_for<K>(page(id), key);
+    }
+    return id;
+  }
 
-    auto it = lower.size() == 0 ? index.map->begin() : index.map->lower_bound(lower);
-    auto end = upper.size() == 0 ? index.map->end() : index.map->upper_bound(upper);
+  template<typename K>
+  std::optional<IndexValue> Index<K>::lossy_put(const PolarString &key, const IndexValue &val) {
+    std::vector<uint64_t> path;
+    uint64_t id = find_leaf(key, &path);
+    IndexPage *leaf = page(id);
+
+    size_t pos = lower_bound<K>(leaf, key);
+    std::string payload = encode_value(val);
+    if(matches<K>(leaf, pos, key)) {
+      char *at = (char*) record_payload<K>(record(leaf, pos));
+      IndexValue old = decode_value(at);
+      lock_page(id);
+      if(payload_size(0, at) == payload.size()) {
+        memcpy(at, payload.data(), payload.size());
+        touch(id);
+      } else {
+        // An inline value changed size, the record goes in anew
+        erase(leaf, pos);
+        insert(path, id, pos, make_record<K>(key, payload.data(), payload.size()));
+      }
+      unlock_pages();
+      return old;
+    }
 
-    auto pit = pending.begin();
-    auto pend = pending.end();
+    insert(path, id, pos, make_record<K>(key, payload.data(), payload.size()));
+    unlock_pages();
+    ++meta()->count;
+    touch(0);
+    return {};
+  }
 
-    while(it != end) {
-      while(pit != pend && pit->first < it->first) {
-        visitor.Visit(pit->first, store.fetch(pit->second));
-        ++pit;
+  // `rec` carries its full key
+  template<typename K>
+  void Index<K>::insert(std::vector<uint64_t> &path, uint64_t id, size_t pos, std::string rec) {
+    while(true) {
+      IndexPage *p = page(id);
+      lock_page(id);
+      if(record_key<K>(rec.data()).starts_with(page_prefix(p))) {
+        std::string packed = strip_prefix<K>(rec, p->prefix);
+        if(free_space(p) >= packed.size() + sizeof(uint16_t)) {
+          place(p, pos, packed);
+          touch(id);
+          return;
+        }
       }
 
-      while(pit != pend && it != end && pit->first == it->first) {
-        visitor.Visit(pit->first, store.fetch(pit->second));
-        ++it;
-        ++pit;
+      uint16_t level = p->level;
+      std::vector<std::string> recs;
+      recs.reserve(p->count + 1);
+      for(size_t i = 0; i<p->count; ++i) {
+        if(i == pos) recs.push_back(rec);
+        recs.push_back(full_record<K>(p, i));
+      }
+      if(pos == p->count) recs.push_back(rec);
+      size_t n = recs.size();
+
+      // The new key cut the prefix short, but everything may still fit
+      if(packed_size<K>(recs, 0, n) <= INDEX_PAGE_SIZE) {
+        build_page<K>(p, level, p->link, recs, 0, n);
+        touch(id);
+        return;
       }
 
-      if(it == end) break;
+      // Split
+      uint64_t right_id = alloc_page();
+      lock_page(right_id);
+      IndexPage *left = page(id);
+      IndexPage *right = page(right_id);
+
+      // Leaves keep at least one record on each side, inner pages also need one
+      // in the middle to promote. Start from halving the bytes, and move away
+      // until both sides fit with their own prefixes. Putting the new record
+      // alone on its side always does
+      size_t lo = 1, hi = level == 0 ? n - 1 : n - 2;
+      size_t total = 0;
+      for(const auto &r : recs) total += r.size();
+
+      size_t mid = lo, acc = recs[0].size();
+      while(mid < hi && acc + recs[mid].size() <= total / 2)
+        acc += recs[mid++].size();
+
+      auto fits = [&](size_t m) {
+        size_t right_begin = level == 0 ? m : m + 1;
+        return packed_size<K>(recs, 0, m) <= INDEX_PAGE_SIZE && packed_size<K>(recs, right_begin, n) <= INDEX_PAGE_SIZE;
+      };
+      for(size_t d = 0; d <= n; ++d) {
+        if(mid >= lo + d && fits(mid - d)) {
+          mid -= d;
+          break;
+        }
+        if(mid + d <= hi && fits(mid + d)) {
+          mid += d;
+          break;
+        }
+      }
 
-      visitor.Visit(it->first, store.fetch(it->second));
-      ++it;
-    }
+      size_t right_begin = level == 0 ? mid : mid + 1;
+      build_page<K>(right, level, level == 0 ? left->link : record_child<K>(recs[mid].data()), recs, right_begin, n);
+      build_page<K>(left, level, level == 0 ? right_id : left->link, recs, 0, mid);
+      touch(id);
+      touch(right_id);
+
+      rec = make_record<K>(record_key<K>(recs[mid].data()), &right_id, sizeof(right_id));
+
+      if(path.empty()) {
+        uint64_t root_id = alloc_page();
+        IndexPage *root = page(root_id);
+        lock_page(root_id);
+        lock_page(0);
+        init_page(root, level + 1, id);
+        place(root, 0, rec);
+        meta()->root = root_id;
+        ++meta()->height;
+        touch(root_id);
+        touch(0);
+        return;
+      }
 
-    while(pit != pend) {
-      visitor.Visit(it->first, store.fetch(pit->second));
-      ++pit;
+      id = path.back();
+      path.pop_back();
+      pos = lower_bound<K>(page(id), record_key<K>(rec.data()));
     }
+  }
 
-    return kSucc;
+  template<typename K>
+  bool Index<K>::Builder::add(const PolarString &key, const IndexValue &val) {
+    std::string payload = encode_value(val);
+    append(0, key, make_record<K>(key, payload.data(), payload.size()), 0);
+    ++count;
+    return !failed;
   }
 
-  template<typename C>
-  void EngineRace::clear_queue(C *queue) {
-    // TODO: figure out why locking the read lock here causes a dead lock
-    if(queue->size() == 0) return;
+  // Whether the open page of `lv` takes one more record of `size` bytes for
+  // `key`, within INDEX_BULK_FILL. Records carry their full keys until the
+  // page is built, see packed_size
+  template<typename K>
+  bool Index<K>::Builder::fits(const Level &lv, const PolarString &key, size_t size) const {
+    size_t n = lv.recs.size() + 1;
+    size_t prefix = K::width > 0 ? 0 : common_prefix(record_key<K>(lv.recs.front().data()), key);
+    size_t bytes = sizeof(IndexPage) + prefix + lv.bytes + size + n * sizeof(uint16_t) - n * prefix;
+    return bytes <= INDEX_PAGE_SIZE * INDEX_BULK_FILL;
+  }
+
+  // `rec` is the record for a leaf, or the separator for `child` on an inner
+  // level. The first child of an inner page is its link instead
+  template<typename K>
+  void Index<K>::Builder::append(size_t level, const PolarString &key, std::string rec, uint64_t child) {
+    if(levels.size() <= level)
+      levels.resize(level + 1);
+
+    bool full = !levels[level].recs.empty() && !fits(levels[level], key, rec.size());
+    if(full)
+      emit(level);
+
+    Level &lv = levels[level];
+    if(level > 0 && lv.link == 0) {
+      lv.link = child;
+      lv.first = key.ToString();
+      return;
+    }
+    if(level == 0 && lv.recs.empty())
+      lv.first = key.ToString();
+    lv.bytes += rec.size();
+    lv.recs.push_back(std::move(rec));
+  }
 
-    std::unique_lock lock(read_lock);
+  // Writes out the open page of `level` and adds it to the one above
+  template<typename K>
+  void Index<K>::Builder::emit(size_t level) {
+    Level lv = std::move(levels[level]);
+    levels[level] = Level();
 
+    if(failed || !index.ensure(1)) {
+      failed = true;
+      return;
+    }
+    uint64_t id = index.alloc_page();
+    if(first_page == 0)
+      first_page = id;
+    if(level == 0) {
+      build_page<K>(index.page(id), 0, 0, lv.recs, 0, lv.recs.size());
+      if(prev_leaf)
+        index.page(prev_leaf)->link = id;
+      prev_leaf = id;
+    } else {
+      build_page<K>(index.page(id), level, lv.link, lv.recs, 0, lv.recs.size());
+    }
     index.check_free_space();
 
-    for(auto &[k, v] : *queue)
-      index.lossy_put(k, v);
+    append(level + 1, lv.first, make_record<K>(lv.first, &id, sizeof(id)), id);
+  }
+
+  template<typename K>
+  bool Index<K>::Builder::publish() {
+    if(count == 0) return true;
+
+    // Close the open pages bottom-up, until a level holds nothing but the
+    // link to the root
+    size_t level = 0;
+    for(; level == 0 || level + 1 < levels.size() || !levels[level].recs.empty(); ++level)
+      emit(level);
+    if(failed) return false;
+
+    // Nothing points at the new pages yet, so they go out first. The meta
+    // page fits in a sector, so the switch is all or nothing
+    msync(index.base + first_page * INDEX_PAGE_SIZE, (index.meta()->pages - first_page) * INDEX_PAGE_SIZE, MS_SYNC);
+    index.lock_page(0);
+    index.meta()->root = levels[level].link;
+    index.meta()->height = level - 1;
+    index.meta()->count = count;
+    index.unlock_pages();
+    index.touch(0);
     index.persist();
+    published = true;
+    return true;
+  }
+
+  template<typename K>
+  void Index<K>::Builder::abandon() {
+    // Nothing points at them yet
+    index.meta()->pages = start;
+    index.used.store(start);
+    index.touch(0);
+  }
+
+  template<typename K>
+  uint64_t Index<K>::alloc_page() {
+    // Only if the grower fell behind
+    if(meta()->pages == capacity.load())
+      grow();
 
-    queue->clear();
+    touch(0);
+    used.store(meta()->pages + 1);
+    return meta()->pages++;
+  }
+
+  template<typename K>
+  bool Index<K>::ensure(size_t pages) {
+    if(meta()->pages + pages > capacity.load())
+      grow();
+    return meta()->pages + pages <= capacity.load();
+  }
+
+  template<typename K>
+  void Index<K>::persist() {
+    // Writeback starts for each run of consecutive dirty pages, in file
+    // order, then a single fdatasync waits for all of them
+    auto start = std::chrono::steady_clock::now();
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+    uint64_t bytes = 0;
+    for(size_t i = 0; i<dirty.size(); ) {
+      size_t j = i + 1;
+      while(j < dirty.size() && dirty[j] == dirty[j-1] + 1) ++j;
+
+      sync_file_range(fd, dirty[i] * INDEX_PAGE_SIZE, (j - i) * INDEX_PAGE_SIZE, SYNC_FILE_RANGE_WRITE);
+      bytes += (j - i) * INDEX_PAGE_SIZE;
+      i = j;
+    }
+    if(bytes > 0)
+      fdatasync(fd);
+    dirty.clear();
+
+    uint64_t took = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    persists.fetch_add(1, std::memory_order_relaxed);
+    flushed.fetch_add(bytes, std::memory_order_relaxed);
+    last_flushed.store(bytes, std::memory_order_relaxed);
+    flush_nanos.fetch_add(took, std::memory_order_relaxed);
+    last_flush_nanos.store(took, std::memory_order_relaxed);
+  }
+
+  template<typename K>
+  IndexFlushStats Index<K>::flush_stats() const {
+    return IndexFlushStats {
+      .persists = persists.load(std::memory_order_relaxed),
+      .bytes = flushed.load(std::memory_order_relaxed),
+      .last_bytes = last_flushed.load(std::memory_order_relaxed),
+      .nanos = flush_nanos.load(std::memory_order_relaxed),
+      .last_nanos = last_flush_nanos.load(std::memory_order_relaxed),
+    };
+  }
+
+  template<typename K>
+  size_t Index<K>::threshold(size_t pages) {
+    return std::max(GROW_THRESHOLD, pages / 4);
+  }
+
+  template<typename K>
+  void Index<K>::check_free_space() {
+    if(capacity.load() - used.load() < threshold(capacity.load())) {
+      std::lock_guard lock(grow_mut);
+      grow_wanted = true;
+      grow_cv.notify_one();
+    }
+  }
+
+  template<typename K>
+  void Index<K>::grow_worker() {
+    std::unique_lock lock(grow_mut);
+    while(true) {
+      grow_cv.wait(lock, [this]() { return grow_wanted || stopping; });
+      if(stopping) break;
+      grow_wanted = false;
+
+      lock.unlock();
+      grow();
+      lock.lock();
+    }
   }
+
+  // Extends the file and maps the new part in place. Pages already mapped
+  // stay where they are, so readers go on while this runs
+  template<typename K>
+  void Index<K>::grow() {
+    std::lock_guard lock(resize_mut);
+
+    size_t cap = capacity.load();
+    if(cap - used.load() >= threshold(cap)) return;
+
+    size_t pages = std::min(std::max(cap, GROW_CHUNK), GROW_MAX_CHUNK);
+    pages = std::min(pages, INDEX_RESERVE / INDEX_PAGE_SIZE - cap);
+    if(pages == 0) {
+      std::cout<<"Index is out of reserved address space"<<std::endl;
+      return;
+    }
+
+    if(ftruncate(fd, (cap + pages) * INDEX_PAGE_SIZE) != 0) return;
+    void *added = mmap(base + cap * INDEX_PAGE_SIZE, pages * INDEX_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, cap * INDEX_PAGE_SIZE);
+    if(added == MAP_FAILED) return;
+
+    capacity.store(cap + pages);
+  }
+
+  // Never written to, as a new file is until the first persist
+  static bool blank(const IndexMeta &m) {
+    IndexMeta zero {};
+    return memcmp(&m, &zero, sizeof(m)) == 0;
+  }
+
+  template<typename K>
+  bool Index<K>::map_file() {
+    auto failed = [&](const char *what) {
+      std::cout<<"Cannot "<<what<<" "<<file_path<<": "<<strerror(errno)<<std::endl;
+      return false;
+    };
+
+    fd = ::open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return failed("open");
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) return failed("stat");
+    if((size_t) st.st_size < GROW_CHUNK * INDEX_INITIAL_CHUNK * INDEX_PAGE_SIZE) {
+      if(ftruncate(fd, GROW_CHUNK * INDEX_INITIAL_CHUNK * INDEX_PAGE_SIZE) != 0 || fstat(fd, &st) != 0)
+        return failed("extend");
+    }
+
+    // Address space only, nothing is committed until the file is mapped over
+    // it. It is readable so that lookups racing with a writer never fault
+    void *reserved = mmap(nullptr, INDEX_RESERVE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reserved == MAP_FAILED) return failed("reserve address space for");
+    base = (char*) reserved;
+    void *counters = mmap(nullptr, INDEX_RESERVE / INDEX_PAGE_SIZE * sizeof(uint64_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(counters == MAP_FAILED) return failed("reserve page versions for");
+    versions = (std::atomic<uint64_t>*) counters;
+    capacity = st.st_size / INDEX_PAGE_SIZE;
+    if(mmap(base, capacity * INDEX_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+      return failed("map");
+
+    if(meta()->magic == INDEX_MAGIC) {
+      // A crashed process may have left pages dirty that we never touch again
+      // while replaying its journal, so they go out once, in full
+      msync(base, meta()->pages * INDEX_PAGE_SIZE, MS_SYNC);
+    } else if(!blank(*meta())) {
+      // Open refuses these first, see formatted
+      std::cout<<file_path<<" is not an index"<<std::endl;
+      return false;
+    } else {
+      // New index, a single empty leaf as the root
+      *meta() = IndexMeta {
+        .magic = INDEX_MAGIC,
+        .page_size = INDEX_PAGE_SIZE,
+        .root = 1,
+        .height = 0,
+        .pages = 2,
+        .count = 0,
+        .key_width = K::width,
+      };
+      init_page(page(1), 0, 0);
+      touch(0);
+      touch(1);
+      persist();
+    }
+
+    used = meta()->pages;
+    return true;
+  }
+
+  template<typename K>
+  bool Index<K>::formatted(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return true;
+
+    IndexMeta m {};
+    bool ok = pread(fd, &m, sizeof(m), 0) <= 0 || m.magic == INDEX_MAGIC || blank(m);
+    ::close(fd);
+    return ok;
+  }
+
+  template<typename K>
+  bool Index<K>::compatible(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return true;
+
+    IndexMeta m;
+    bool ok = pread(fd, &m, sizeof(m), 0) != sizeof(m) || m.magic != INDEX_MAGIC || m.key_width == K::width;
+    ::close(fd);
+    return ok;
+  }
+
+  template<typename K>
+  std::optional<IndexValue> Index<K>::get(const PolarString &key) {
+    while(true) {
+      uint64_t v;
+      uint64_t id = optimistic_leaf(key, v);
+
+      std::optional<IndexValue> result;
+      const IndexPage *leaf = page(id);
+      size_t pos = lower_bound<K>(leaf, key);
+      if(matches<K>(leaf, pos, key)) {
+        // The fields are copied once and checked on the copy, a writer may
+        // change them meanwhile. Inline bytes are only copied once they are
+        // known to be in the page
+        const char *at = record_payload<K>(record(leaf, pos));
+        const char *end = (const char*) leaf + INDEX_PAGE_SIZE;
+        if(at + VALUE_FIELDS > end) continue;
+        IndexValue val = decode_fields(at);
+        if(val.is_inline()) {
+          if(val.len > INLINE_MAX || at + VALUE_FIELDS + val.len > end) continue;
+          val.data = std::make_shared<const std::string>(at + VALUE_FIELDS, val.len);
+        }
+        result = std::move(val);
+      }
+      if(unchanged(id, v)) return result;
+    }
+  }
+
+  // Optimistic lock coupling: every page is read without a lock, and the
+  // descent starts over if one changed while we were on it. The leaf still
+  // has to be checked against `version` once it has been read
+  template<typename K>
+  uint64_t Index<K>::optimistic_leaf(const PolarString &key, uint64_t &version) const {
+    while(true) {
+      uint64_t v0 = stable(0);
+      uint64_t id = meta()->root;
+      if(id == 0 || id >= used.load(std::memory_order_acquire)) continue;
+      uint64_t v = stable(id);
+      if(!unchanged(0, v0)) continue;
+
+      // Descend only through a parent that held still while we read the child
+      bool torn = false;
+      while(!torn) {
+        const IndexPage *p = page(id);
+        if(!sane(p)) {
+          torn = true;
+        } else if(p->level > 0) {
+          uint64_t child = child_for<K>(p, key);
+          if(child == 0 || child >= used.load(std::memory_order_acquire)) {
+            torn = true;
+          } else {
+            uint64_t cv = stable(child);
+            torn = !unchanged(id, v);
+            id = child;
+            v = cv;
+          }
+        } else {
+          break;
+        }
+      }
+      if(torn) continue;
+
+      version = v;
+      return id;
+    }
+  }
+
+  template<typename K>
+  uint64_t Index<K>::stable(uint64_t id) const {
+    for(size_t spins = 0; ; ++spins) {
+      uint64_t v = versions[id].load(std::memory_order_acquire);
+      if(!(v & 1)) return v;
+      if(spins > 64) std::this_thread::yield();
+    }
+  }
+
+  template<typename K>
+  bool Index<K>::unchanged(uint64_t id, uint64_t v) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return versions[id].load(std::memory_order_relaxed) == v;
+  }
+
+  // Writers make the version odd while they change a page, and even again
+  // once the whole lossy_put is done
+  template<typename K>
+  void Index<K>::lock_page(uint64_t id) {
+    if(std::find(locked.begin(), locked.end(), id) != locked.end()) return;
+    versions[id].store(versions[id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    locked.push_back(id);
+  }
+
+  template<typename K>
+  void Index<K>::unlock_pages() {
+    for(uint64_t id : locked)
+      versions[id].store(versions[id].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    locked.clear();
+  }
+
+  template<typename K>
+  Index<K>::Cursor::Cursor(Index &index, const PolarString &lower)
+    : index(index), copy(INDEX_PAGE_SIZE / sizeof(uint64_t)) {
+    while(true) {
+      uint64_t v;
+      page = index.optimistic_leaf(lower, v);
+      memcpy(copy.data(), index.page(page), INDEX_PAGE_SIZE);
+      if(index.unchanged(page, v)) break;
+    }
+    slot = lower_bound<K>(leaf(), lower);
+    settle();
+  }
+
+  // A split only moves keys into a new page to the right of the old one, so
+  // following the link of a stale copy skips nothing the copy did not have
+  template<typename K>
+  void Index<K>::Cursor::settle() {
+    while(page != 0 && slot == leaf()->count) {
+      page = leaf()->link;
+      slot = 0;
+      while(page != 0) {
+        uint64_t v = index.stable(page);
+        memcpy(copy.data(), index.page(page), INDEX_PAGE_SIZE);
+        if(index.unchanged(page, v)) break;
+      }
+    }
+  }
+
+  template<typename K>
+  bool Index<K>::Cursor::valid() const {
+    return page != 0;
+  }
+
+  template<typename K>
+  PolarString Index<K>::Cursor::key() const {
+    // Without a page prefix, the key is whole in the record
+    if constexpr(K::width > 0)
+      return record_key<K>(record(leaf(), slot));
+
+    buf = full_key<K>(leaf(), slot);
+    return buf;
+  }
+
+  template<typename K>
+  IndexValue Index<K>::Cursor::value() const {
+    return decode_value(record_payload<K>(record(leaf(), slot)));
+  }
+
+  template<typename K>
+  void Index<K>::Cursor::next() {
+    ++slot;
+    settle();
+  }
+
+  void Store::scan() {
+    for(auto &file : fs::directory_iterator(basedir)) {
+      auto fn = file.path().filename();
+      size_t integer = std::stoi(fn);
+      std::cout<<"File: "<<integer<<std::endl;
+      if(integer >= file_counter) {
+        file_counter = integer;
+        offset = fs::file_size(file.path());
+
+        std::cout<<"Offset: "<<offset<<std::endl;
+      }
+    }
+  }
+
+  bool Store::resume(const StoreTail &hint) {
+    std::error_code ec;
+    size_t file = hint.file;
+    size_t size = fs::file_size(basedir + "/" + std::to_string(file), ec);
+    if(ec) return false;
+
+    // The manifest may be behind by the segments opened since it was written.
+    // None of those is compacted away, so the first gap is the end
+    while(true) {
+      size_t next = fs::file_size(basedir + "/" + std::to_string(file + 1), ec);
+      if(ec) break;
+      ++file;
+      size = next;
+    }
+
+    file_counter = file;
+    offset = size;
+    // Appends that never made it to the disk. The index may point below the
+    // recorded tail, so those offsets are not handed out again
+    if(file == hint.file && size < hint.offset) {
+      std::cout<<"Segment "<<file<<" ends at "<<size<<", before its recorded tail "<<hint.offset<<std::endl;
+      offset = hint.offset;
+    }
+    return true;
+  }
+
+  StoreTail Store::tail() const {
+    const uint64_t mask = ((uint64_t) 1 << STORE_OFFSET_BITS) - 1;
+    uint64_t cur = cursor.load(std::memory_order_acquire);
+    return StoreTail {
+      .file = cur >> STORE_OFFSET_BITS,
+      .offset = std::min(cur & mask, (uint64_t) max_filesize),
+    };
+  }
+
+  void Store::recorded(const StoreTail &tail) {
+    kept.store(tail.file, std::memory_order_release);
+  }
+
+  std::optional<IndexValue> Store::reserve(size_t len) {
+    const uint64_t mask = ((uint64_t) 1 << STORE_OFFSET_BITS) - 1;
+    // It would not fit any segment
+    if(len > max_filesize) return std::nullopt;
+
+    while(true) {
+      uint64_t cur = cursor.fetch_add(len, std::memory_order_acq_rel);
+      size_t file = cur >> STORE_OFFSET_BITS;
+      size_t off = cur & mask;
+
+      if(off > max_filesize) {
+        // Whoever crossed the limit is rolling over, wait for the next segment
+        while((cursor.load(std::memory_order_acquire) >> STORE_OFFSET_BITS) == file)
+          std::this_thread::yield();
+        continue;
+      }
+
+      // The compactor only takes sealed segments without appends in flight
+      writers[file % STORE_WRITER_SLOTS].fetch_add(1);
+      if(off + len > max_filesize) {
+        // Exactly one writer crosses the limit. It keeps its range, which ends
+        // past the limit, and opens the next segment. It registered before
+        // sealing this one, so the compactor waits for it. Everyone who got an
+        // offset past the limit in the meantime retries
+        segment(file + 1, true);
+        cursor.store((uint64_t) (file + 1) << STORE_OFFSET_BITS, std::memory_order_release);
+        sealed.store(file + 1, std::memory_order_release);
+      } else if(file < sealed.load()) {
+        // Sealed before we registered, so it may be on its way out. The range
+        // is left as a hole and we take another in the next segment
+        writers[file % STORE_WRITER_SLOTS].fetch_sub(1);
+        continue;
+      }
+
+      return IndexValue {
+        .file = file,
+        .offset = off,
+        .len = len,
+      };
+    }
+  }
+
+  std::optional<IndexValue> Store::append(const PolarString &val) {
+    // Whole blocks for direct I/O, so the next value starts aligned too
+    size_t len = direct ? (val.size() + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN : val.size();
+    auto value = reserve(len);
+    if(!value) return std::nullopt;
+
+    auto seg = segment(value->file, true);
+    bool ok = seg && (direct ? write_direct(seg->fd, val.data(), val.size(), value->offset)
+        : pwrite(seg->fd, val.data(), val.size(), value->offset) == (ssize_t) val.size());
+    if(!ok) {
+      release(*value);
+      return std::nullopt;
+    }
+
+    value->file |= tier;
+    value->len = val.size();
+    return value;
+  }
+
+  void Store::release(const IndexValue &loc) {
+    writers[number(loc.file) % STORE_WRITER_SLOTS].fetch_sub(1);
+  }
+
+  template<typename C>
+  std::vector<IndexValue> Store::append(const C &vals) {
+    std::vector<IndexValue> result;
+    result.reserve(vals.size());
+    auto failed = [&]() {
+      for(const auto &loc : result)
+        release(loc);
+      return std::vector<IndexValue>();
+    };
+
+    // One contiguous range per run of values that fits a segment, so a large
+    // batch takes several
+    auto begin = std::begin(vals), end = std::end(vals);
+    while(begin != end) {
+      size_t total = 0, count = 0;
+      auto stop = begin;
+      for(; stop != end && (count == 0 || total + stop->size() <= max_filesize); ++stop, ++count)
+        total += stop->size();
+
+      auto range = reserve(total);
+      if(!range) return failed();
+      // Each location is released on its own
+      writers[range->file % STORE_WRITER_SLOTS].fetch_add(count - 1);
+      size_t first = result.size();
+      size_t offset = range->offset;
+      for(auto it = begin; it != stop; ++it) {
+        // std::cout<<"[STORE] INSERT: "<<*it<<std::endl;
+        result.push_back(IndexValue {
+          .file = range->file,
+          .offset = offset,
+          .len = it->size(),
+        });
+        offset += it->size();
+      }
+
+      auto seg = segment(range->file, true);
+      if(!seg) return failed();
+
+      std::vector<iovec> iov;
+      size_t written = range->offset;
+      bool ok = true;
+      auto flush = [&](size_t upto) {
+        ok = ok && pwritev(seg->fd, iov.data(), iov.size(), written) == (ssize_t) (upto - written);
+        written = upto;
+        iov.clear();
+      };
+      for(size_t i = first; begin != stop; ++begin, ++i) {
+        iov.push_back({ (void*) begin->data(), begin->size() });
+        if(iov.size() == IOV_MAX)
+          flush(result[i].offset + result[i].len);
+      }
+      if(!iov.empty())
+        flush(offset);
+      if(!ok) return failed();
+    }
+    return result;
+  }
+
+  bool Store::fetch(const IndexValue &loc, std::string *value) {
+    if(loc.is_inline()) {
+      *value = *loc.data;
+      return true;
+    }
+
+    auto seg = segment(number(loc.file));
+    if(!seg) return false;
+
+    value->resize(loc.len);
+    if(direct)
+      return read_direct(seg->fd, loc.offset, loc.len, value->data());
+    return pread(seg->fd, value->data(), loc.len, loc.offset) == (ssize_t) loc.len;
+  }
+
+  bool Store::pin(const IndexValue &loc, PinnedValue *value) {
+    if(loc.is_inline()) {
+      value->Pin(*loc.data, loc.data);
+      return true;
+    }
+
+    if(STORE_MMAP && !direct && loc.file < sealed.load(std::memory_order_acquire)) {
+      auto map = get_mapping(loc.file);
+      if(map && loc.offset + loc.len <= map->size) {
+        value->Pin(PolarString(map->base + loc.offset, loc.len), map);
+        return true;
+      }
+    }
+
+    auto copy = std::make_shared<std::string>();
+    if(!fetch(loc, copy.get())) return false;
+    value->Pin(*copy, copy);
+    return true;
+  }
+
+  bool Store::read(size_t file, size_t offset, size_t len, char *buf) {
+    auto seg = segment(number(file));
+    if(!seg) return false;
+    if(direct)
+      return read_direct(seg->fd, offset, len, buf);
+    return pread(seg->fd, buf, len, offset) == (ssize_t) len;
+  }
+
+  void Store::advise(size_t file, size_t offset, size_t len) {
+    // Direct reads do not go through the page cache
+    if(direct) return;
+
+    auto seg = segment(number(file));
+    if(seg) posix_fadvise(seg->fd, offset, len, POSIX_FADV_WILLNEED);
+  }
+
+  bool Store::read_direct(int fd, size_t offset, size_t len, char *dst) {
+    char *buf = buffers.acquire();
+    if(!buf) return false;
+    size_t begin = offset / BLOB_ALIGN * BLOB_ALIGN;
+    bool ok = true;
+    while(len > 0) {
+      size_t skip = offset - begin;
+      size_t want = std::min(BLOB_BUFFER_SIZE, (skip + len + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN);
+      size_t n = std::min(len, want - skip);
+      ssize_t got = pread(fd, buf, want, begin);
+      if(got < (ssize_t) (skip + n)) {
+        ok = false;
+        break;
+      }
+      memcpy(dst, buf + skip, n);
+      if(!direct_io.load(std::memory_order_relaxed))
+        posix_fadvise(fd, begin, want, POSIX_FADV_DONTNEED);
+
+      dst += n;
+      len -= n;
+      offset += n;
+      begin += want;
+    }
+    buffers.release(buf);
+    return ok;
+  }
+
+  bool Store::write_direct(int fd, const char *src, size_t len, size_t offset) {
+    char *buf = buffers.acquire();
+    if(!buf) return false;
+    bool ok = true;
+    while(len > 0) {
+      size_t n = std::min(len, BLOB_BUFFER_SIZE);
+      size_t want = (n + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN;
+      memcpy(buf, src, n);
+      memset(buf + n, 0, want - n);
+      if(pwrite(fd, buf, want, offset) != (ssize_t) want) {
+        ok = false;
+        break;
+      }
+      // Dirty pages are only dropped once written back, which is fine for a hint
+      if(!direct_io.load(std::memory_order_relaxed))
+        posix_fadvise(fd, offset, want, POSIX_FADV_DONTNEED);
+
+      src += n;
+      len -= n;
+      offset += want;
+    }
+    buffers.release(buf);
+    return ok;
+  }
+
+  void Store::account(const IndexValue &added, const std::optional<IndexValue> &removed) {
+    // Inline values take no segment space, and the other tier counts its own
+    bool add = owns(added), remove = removed && owns(*removed);
+    if(!add && !remove) return;
+
+    std::lock_guard lock(live_mut);
+    size_t top = std::max(add ? number(added.file) : 0, remove ? number(removed->file) : 0);
+    if(top >= live.size())
+      live.resize(top + 1);
+
+    if(add)
+      live[number(added.file)] += added.len;
+    if(remove)
+      live[number(removed->file)] -= removed->len;
+  }
+
+  std::vector<size_t> Store::victims(double ratio, size_t limit) {
+    std::vector<std::pair<double, size_t>> found;
+    size_t end = std::min(sealed.load(), kept.load());
+    for(size_t file = 0; file < end; ++file) {
+      if(writers[file % STORE_WRITER_SLOTS].load() > 0) continue;
+
+      auto seg = segment(file);
+      struct stat st;
+      if(!seg || fstat(seg->fd, &st) != 0 || st.st_size == 0) continue;
+
+      uint64_t bytes;
+      {
+        std::lock_guard lock(live_mut);
+        bytes = file < live.size() ? live[file] : 0;
+      }
+
+      double used = (double) bytes / st.st_size;
+      if(used < ratio)
+        found.emplace_back(used, file);
+    }
+
+    std::sort(found.begin(), found.end());
+    std::vector<size_t> result;
+    for(size_t i = 0; i<found.size() && i<limit; ++i)
+      result.push_back(found[i].second | tier);
+    return result;
+  }
+
+  bool Store::sync(size_t file) {
+    auto seg = segment(number(file));
+    return seg && fdatasync(seg->fd) == 0;
+  }
+
+  size_t Store::drop(size_t file) {
+    file = number(file);
+    std::unique_lock lock(fd_mut);
+    std::string path = basedir + "/" + std::to_string(file);
+    struct stat st;
+    size_t size = ::stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+
+    // Readers that still hold the segment or a mapping of it finish on the
+    // unlinked file, later ones find it gone and look the key up again
+    ::unlink(path.c_str());
+    if(file < segments.size()) segments[file].reset();
+    if(file < maps.size()) maps[file].reset();
+    return size;
+  }
+
+  std::shared_ptr<Store::Mapping> Store::get_mapping(size_t file) {
+    {
+      std::shared_lock lock(fd_mut);
+      if(file < maps.size() && maps[file])
+        return maps[file];
+    }
+
+    auto seg = segment(file);
+    struct stat st;
+    if(!seg || fstat(seg->fd, &st) != 0 || st.st_size == 0) return nullptr;
+
+    std::unique_lock lock(fd_mut);
+    if(file >= maps.size())
+      maps.resize(file + 1);
+    if(!maps[file]) {
+      void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+      if(base == MAP_FAILED) return nullptr;
+      maps[file] = std::make_shared<Mapping>((const char*) base, (size_t) st.st_size);
+    }
+    return maps[file];
+  }
+
+  // Only appends create segments. Null if the file does not exist or cannot
+  // be opened
+  std::shared_ptr<Store::Segment> Store::segment(size_t file, bool create) {
+    {
+      std::shared_lock lock(fd_mut);
+      if(file < segments.size() && segments[file]) {
+        segments[file]->used.store(opens, std::memory_order_relaxed);
+        return segments[file];
+      }
+    }
+
+    std::unique_lock lock(fd_mut);
+    if(file >= segments.size())
+      segments.resize(file + 1);
+    if(!segments[file]) {
+      evict();
+      std::string path = basedir + "/" + std::to_string(file);
+      int flags = O_RDWR | (create ? O_CREAT : 0);
+      bool odirect = direct && direct_io;
+      int fd = ::open(path.c_str(), flags | (odirect ? O_DIRECT : 0), 0644);
+      if(fd < 0 && odirect && errno == EINVAL) {
+        std::cout<<"No O_DIRECT in "<<basedir<<", going through the page cache"<<std::endl;
+        direct_io = false;
+        fd = ::open(path.c_str(), flags, 0644);
+      }
+      if(fd < 0) {
+        // Compacted away is expected, anything else is worth a line
+        if(errno != ENOENT)
+          std::cout<<"Cannot open segment "<<path<<": "<<strerror(errno)<<std::endl;
+        return nullptr;
+      }
+      segments[file] = std::make_shared<Segment>(fd);
+      segments[file]->used.store(++opens, std::memory_order_relaxed);
+    }
+    return segments[file];
+  }
+
+  // Under fd_mut. Readers still holding the segment keep its fd until they
+  // are done. Segments with appends in flight are synced by the journal
+  // through the fd they were written with, so they stay
+  void Store::evict() {
+    size_t end = std::min(sealed.load(), segments.size());
+    size_t open = 0, oldest = end;
+    for(size_t file = 0; file < end; ++file) {
+      if(!segments[file]) continue;
+      ++open;
+      if(writers[file % STORE_WRITER_SLOTS].load() > 0) continue;
+      if(oldest == end || segments[file]->used.load(std::memory_order_relaxed)
+          < segments[oldest]->used.load(std::memory_order_relaxed))
+        oldest = file;
+    }
+    if(open >= STORE_OPEN_SEGMENTS && oldest < end)
+      segments[oldest].reset();
+  }
+
+  bool Store::holds(const IndexValue &loc) {
+    struct stat st;
+    std::string path = basedir + "/" + std::to_string(number(loc.file));
+    return ::stat(path.c_str(), &st) == 0 && (size_t) st.st_size >= loc.offset + loc.len;
+  }
+
+  BufferPool::~BufferPool() {
+    for(char *buf : free)
+      ::free(buf);
+  }
+
+  char* BufferPool::acquire() {
+    {
+      std::lock_guard lock(mut);
+      if(!free.empty()) {
+        char *buf = free.back();
+        free.pop_back();
+        return buf;
+      }
+    }
+
+    void *buf = nullptr;
+    if(posix_memalign(&buf, BLOB_ALIGN, BLOB_BUFFER_SIZE) != 0) return nullptr;
+    return (char*) buf;
+  }
+
+  void BufferPool::release(char *buf) {
+    {
+      std::lock_guard lock(mut);
+      if(free.size() < BLOB_POOL_BUFFERS) {
+        free.push_back(buf);
+        return;
+      }
+    }
+    ::free(buf);
+  }
+
+  std::shared_ptr<const std::string> ValueCache::get(const IndexValue &loc) {
+    if(!enabled() || loc.is_inline() || loc.is_blob()) return nullptr;
+
+    uint64_t key = id(loc);
+    Shard &s = shard(key);
+    std::lock_guard lock(s.mut);
+    auto it = s.slots.find(key);
+    if(it == s.slots.end()) {
+      ++s.misses;
+      return nullptr;
+    }
+
+    ++s.hits;
+    Entry &e = s.ring[it->second];
+    e.referenced = true;
+    return e.value;
+  }
+
+  void ValueCache::put(const IndexValue &loc, std::shared_ptr<const std::string> value) {
+    if(!keeps(loc)) return;
+
+    uint64_t key = id(loc);
+    Shard &s = shard(key);
+    std::lock_guard lock(s.mut);
+    if(s.slots.count(key)) return;
+
+    // Sweep until there is room, sparing what was read since the last pass
+    while(s.bytes + value->size() > shard_budget && !s.ring.empty()) {
+      if(s.hand >= s.ring.size()) s.hand = 0;
+      Entry &e = s.ring[s.hand];
+      if(e.referenced) {
+        e.referenced = false;
+        ++s.hand;
+        continue;
+      }
+
+      s.bytes -= e.value->size();
+      s.slots.erase(e.id);
+      ++s.evictions;
+      if(s.hand != s.ring.size() - 1) {
+        e = std::move(s.ring.back());
+        s.slots[e.id] = s.hand;
+      }
+      s.ring.pop_back();
+    }
+
+    s.bytes += value->size();
+    s.slots[key] = s.ring.size();
+    s.ring.push_back({ key, std::move(value), false });
+  }
+
+  CacheStats ValueCache::stats() {
+    CacheStats total {};
+    for(auto &s : shards) {
+      std::lock_guard lock(s.mut);
+      total.hits += s.hits;
+      total.misses += s.misses;
+      total.evictions += s.evictions;
+      total.bytes += s.bytes;
+    }
+    return total;
+  }
+
+  RetCode Engine::Open(const std::string& name, Engine** eptr) {
+    if(ENGINE_SHARDS > 1)
+      return ShardedEngine<DefaultKey>::Open(name, ENGINE_SHARDS, eptr);
+    return EngineRace<DefaultKey>::Open(name, eptr);
+  }
+
+  Engine::~Engine() {}
+
+  RetCode Engine::Write(const WriteBatch& batch) {
+    return kNotSupported;
+  }
+
+  RetCode Engine::BulkLoad(BulkSource& source) {
+    return kNotSupported;
+  }
+
+  RetCode Engine::ReadPinned(const PolarString& key, PinnedValue* value) {
+    auto copy = std::make_shared<std::string>();
+    RetCode ret = Read(key, copy.get());
+    if(ret == kSucc)
+      value->Pin(*copy, copy);
+    return ret;
+  }
+
+  void Engine::MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values, std::vector<RetCode>* statuses) {
+    values->assign(keys.size(), std::string());
+    statuses->resize(keys.size());
+    for(size_t i = 0; i<keys.size(); ++i)
+      (*statuses)[i] = Read(keys[i], &(*values)[i]);
+  }
+
+  /*
+   * Complete the functions below to implement you own engine
+   */
+
+  // 1. Open engine
+  template<typename K>
+  RetCode EngineRace<K>::Open(const std::string& name, Engine** eptr) {
+    std::experimental::filesystem::create_directory(name);
+    *eptr = NULL;
+    if(fs::exists(name+"/"+SHARD_FILE)) {
+      std::cout<<"Directory holds a sharded engine"<<std::endl;
+      return kInvalidArgument;
+    }
+    if(!Index<K>::compatible(name+"/"+INDEX_FILE)) {
+      std::cout<<"Index was created for another key width"<<std::endl;
+      return kInvalidArgument;
+    }
+
+    // Rather than start over on top of them
+    if(!Index<K>::formatted(name+"/"+INDEX_FILE)) {
+      std::cout<<"Index is not in this engine's format"<<std::endl;
+      return kCorruption;
+    }
+    if(!Journal<K>::formatted(name+"/"+JOURNAL_FILE)) {
+      std::cout<<"Journal is not in this engine's format"<<std::endl;
+      return kCorruption;
+    }
+
+    EngineRace *engine_race = new EngineRace(name);
+    if(!engine_race->journal.ok() || !engine_race->index.ok()) {
+      delete engine_race;
+      return kIOError;
+    }
+
+    *eptr = engine_race;
+    return kSucc;
+  }
+
+  // 3. Write a key-value pair into engine
+  template<typename K>
+  RetCode EngineRace<K>::Write(const PolarString& key, const PolarString& value) {
+    if(!K::accepts(key) || value.size() > MAX_VAL_LEN) return kInvalidArgument;
+
+    // Small values only take the journal write
+    if(inlined(value)) {
+      if(!journal.push({ key, inline_value(value) })) return kIOError;
+      return kSucc;
+    }
+
+    // Large ones skip the page cache
+    Store &to = is_blob(value) ? blobs : store;
+    auto loc = to.append(value);
+    if(!loc) return kIOError;
+    bool ok = journal.push({ key, *loc });
+    to.release(*loc);
+    if(!ok) return kIOError;
+    return kSucc;
+  }
+
+  template<typename K>
+  bool EngineRace<K>::inlined(const PolarString& value) {
+    return INLINE_MAX > 0 && value.size() <= INLINE_MAX;
+  }
+
+  template<typename K>
+  bool EngineRace<K>::is_blob(const PolarString& value) {
+    return BLOB_MIN > 0 && value.size() >= BLOB_MIN;
+  }
+
+  template<typename K>
+  IndexValue EngineRace<K>::inline_value(const PolarString& value) {
+    return IndexValue {
+      .file = INLINE_FILE,
+      .offset = 0,
+      .len = value.size(),
+      .data = std::make_shared<const std::string>(value.ToString()),
+    };
+  }
+
+  template<typename K>
+  bool EngineRace<K>::acceptable(const WriteBatch& batch) {
+    // The batch is a single journal frame, which has to fit the ring
+    size_t bytes = 0;
+    for(size_t i = 0; i<batch.Count(); ++i) {
+      const auto &key = batch.keys()[i], &value = batch.values()[i];
+      if(!K::accepts(key) || value.size() > MAX_VAL_LEN) return false;
+      bytes += key.size() + JOURNAL_ENTRY_OVERHEAD + (inlined(value) ? value.size() : 0);
+    }
+    return bytes <= JOURNAL_FRAME_LIMIT;
+  }
+
+  template<typename K>
+  RetCode EngineRace<K>::Write(const WriteBatch& batch) {
+    if(!acceptable(batch)) return kInvalidArgument;
+    if(batch.Count() == 0) return kSucc;
+
+    // Contiguous ranges for the values not inlined, except blobs, which are
+    // written one by one
+    std::vector<PolarString> stored;
+    for(const auto &value : batch.values())
+      if(!inlined(value) && !is_blob(value)) stored.emplace_back(value);
+    std::vector<IndexValue> locs;
+    if(!stored.empty()) {
+      locs = store.append(stored);
+      if(locs.empty()) return kIOError;
+    }
+
+    bool ok = true;
+    std::vector<IndexValue> large;
+    std::vector<typename Journal<K>::Entry> group;
+    group.reserve(batch.Count());
+    for(size_t i = 0, next = 0; ok && i<batch.Count(); ++i) {
+      const auto &value = batch.values()[i];
+      if(inlined(value)) {
+        group.emplace_back(batch.keys()[i], inline_value(value));
+      } else if(is_blob(value)) {
+        auto loc = blobs.append(PolarString(value));
+        ok = loc.has_value();
+        if(!ok) break;
+        large.push_back(*loc);
+        group.emplace_back(batch.keys()[i], *loc);
+      } else {
+        group.emplace_back(batch.keys()[i], locs[next++]);
+      }
+    }
+
+    // Nothing of the batch goes into the journal unless all of it was written
+    ok = ok && journal.push(group);
+    for(const auto &loc : locs)
+      store.release(loc);
+    for(const auto &loc : large)
+      blobs.release(loc);
+    if(!ok) return kIOError;
+    return kSucc;
+  }
+
+  template<typename K>
+  RetCode EngineRace<K>::BulkLoad(BulkSource& source) {
+    // Keeps the sync thread off the index until the new tree is in place.
+    // Values written before a failure are left as garbage, uncounted, and
+    // the builder gives its pages back
+    std::lock_guard lock(bulk_mut);
+    if(!index.empty() || journal.last_seq() != journal.applied_seq()) return kInvalidArgument;
+
+    typename Index<K>::Builder builder(index);
+    std::vector<std::string> keys;
+    std::vector<IndexValue> locs;
+    std::vector<std::string> stored; // Values for the store, in key order
+    std::vector<size_t> slots;       // Their place in locs
+    size_t bytes = 0;
+    // Bytes per segment, counted once the tree is in place
+    std::map<size_t, uint64_t> written;
+
+    auto placed = [&](const IndexValue &loc) {
+      written[loc.file] += loc.len;
+    };
+
+    // Contiguous ranges for the chunk, and then its keys in order
+    auto flush = [&]() {
+      if(!stored.empty()) {
+        auto appended = store.append(stored);
+        if(appended.empty()) return false;
+        for(size_t i = 0; i<appended.size(); ++i) {
+          store.release(appended[i]);
+          locs[slots[i]] = appended[i];
+          placed(appended[i]);
+        }
+      }
+      for(size_t i = 0; i<keys.size(); ++i)
+        if(!builder.add(keys[i], locs[i])) return false;
+
+      keys.clear();
+      locs.clear();
+      stored.clear();
+      slots.clear();
+      bytes = 0;
+      return true;
+    };
+
+    std::string last;
+    bool first = true;
+    PolarString key, value;
+    while(source.Next(&key, &value)) {
+      if(!K::accepts(key) || value.size() > MAX_VAL_LEN
+          || (!first && K::compare(PolarString(last), key) >= 0)) return kInvalidArgument;
+      last = key.ToString();
+      first = false;
+
+      keys.push_back(last);
+      if(inlined(value)) {
+        locs.push_back(inline_value(value));
+      } else if(is_blob(value)) {
+        auto loc = blobs.append(value);
+        if(!loc) return kIOError;
+        blobs.release(*loc);
+        locs.push_back(*loc);
+        placed(*loc);
+      } else {
+        locs.emplace_back();
+        slots.push_back(locs.size() - 1);
+        stored.push_back(value.ToString());
+        bytes += value.size();
+      }
+
+      if((keys.size() == BULK_CHUNK || bytes >= BULK_CHUNK_BYTES) && !flush()) return kIOError;
+    }
+    if(!flush()) return kIOError;
+
+    // The values have to be on the disk before the index points at them
+    for(const auto &[file, total] : written)
+      if(!(file & BLOB_TIER ? blobs : store).sync(file)) return kIOError;
+    if(!builder.publish()) return kIOError;
+
+    for(const auto &[file, total] : written) {
+      IndexValue segment { .file = file, .offset = 0, .len = total };
+      store.account(segment, {});
+      blobs.account(segment, {});
+    }
+    return kSucc;
+  }
+
+  template<typename K>
+  std::optional<IndexValue> EngineRace<K>::locate(const PolarString& key) {
+    auto loc = journal.fetch(key);
+
+    if(!loc)
+      loc = index.get(key);
+
+    return loc;
+  }
+
+  // A segment that is gone or too short means the index is wrong. Otherwise
+  // the segment could not be read, or opened, which Store::segment logs
+  template<typename K>
+  RetCode EngineRace<K>::unreadable(const IndexValue &loc) {
+    return tier(loc).holds(loc) ? kIOError : kCorruption;
+  }
+
+  // 4. Read value of a key
+  template<typename K>
+  RetCode EngineRace<K>::Read(const PolarString& key, std::string* value) {
+    // A segment is only deleted after the index has the new locations of its
+    // values, so the second lookup finds the key elsewhere
+    std::optional<IndexValue> stale;
+    while(true) {
+      auto loc = locate(key);
+      if(!loc) return kNotFound;
+
+      if(auto hit = cache.get(*loc)) {
+        *value = *hit;
+        return kSucc;
+      }
+      // Read into the copy the cache keeps, if it keeps one
+      if(!cache.keeps(*loc)) {
+        if(tier(*loc).fetch(*loc, value)) return kSucc;
+      } else if(auto fetched = std::make_shared<std::string>(); tier(*loc).fetch(*loc, fetched.get())) {
+        *value = *fetched;
+        cache.put(*loc, std::move(fetched));
+        return kSucc;
+      }
+      if(stale && stale->file == loc->file) return unreadable(*loc);
+      stale = loc;
+    }
+  }
+
+  template<typename K>
+  RetCode EngineRace<K>::ReadPinned(const PolarString& key, PinnedValue* value) {
+    std::optional<IndexValue> stale;
+    while(true) {
+      auto loc = locate(key);
+      if(!loc) return kNotFound;
+
+      // Mapped values are already served without a copy
+      if(auto hit = cache.get(*loc)) {
+        value->Pin(*hit, hit);
+        return kSucc;
+      }
+      if(tier(*loc).pin(*loc, value)) return kSucc;
+      if(stale && stale->file == loc->file) return unreadable(*loc);
+      stale = loc;
+    }
+  }
+
+  template<typename K>
+  void EngineRace<K>::MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values, std::vector<RetCode>* statuses) {
+    size_t n = keys.size();
+    values->assign(n, std::string());
+    statuses->assign(n, kNotFound);
+
+    std::vector<std::optional<IndexValue>> locs;
+    journal.fetch_all(keys, locs);
+    std::vector<size_t> order;
+    for(size_t i = 0; i<n; ++i) {
+      if(!locs[i]) locs[i] = index.get(keys[i]);
+      if(!locs[i]) continue;
+
+      if(locs[i]->is_inline()) {
+        (*values)[i] = *locs[i]->data;
+        (*statuses)[i] = kSucc;
+      } else if(auto hit = cache.get(*locs[i])) {
+        (*values)[i] = *hit;
+        (*statuses)[i] = kSucc;
+      } else {
+        order.push_back(i);
+      }
+    }
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return std::make_pair(locs[a]->file, locs[a]->offset) < std::make_pair(locs[b]->file, locs[b]->offset);
+    });
+
+    // [begin, end) of order, and the bytes of the segment that cover them
+    struct Run {
+      size_t begin, end;
+      size_t file, offset, len;
+    };
+    std::vector<Run> runs;
+    for(size_t i = 0; i<order.size(); ) {
+      const IndexValue &first = *locs[order[i]];
+      size_t end = first.offset + first.len;
+      size_t j = i + 1;
+      for(; j<order.size(); ++j) {
+        const IndexValue &loc = *locs[order[j]];
+        // Blobs are read one by one, they are large enough already
+        if(loc.file != first.file || first.is_blob() || loc.offset > end + MULTIGET_MERGE_GAP) break;
+        end = std::max(end, (size_t) (loc.offset + loc.len));
+      }
+      runs.push_back({ i, j, first.file, first.offset, end - first.offset });
+      i = j;
+    }
+
+    // Reads that find their segment compacted away are left at kNotFound,
+    // and done again one by one below
+    std::vector<char> gone(n, false);
+    auto read_runs = [&](size_t from, size_t to) {
+      std::string buf;
+      for(size_t r = from; r<to; ++r) {
+        const Run &run = runs[r];
+        bool single = run.end - run.begin == 1;
+        std::string &dst = single ? (*values)[order[run.begin]] : buf;
+        dst.resize(run.len);
+        bool ok = tier(*locs[order[run.begin]]).read(run.file, run.offset, run.len, dst.data());
+
+        for(size_t k = run.begin; k<run.end; ++k) {
+          size_t i = order[k];
+          if(!ok) {
+            gone[i] = true;
+            continue;
+          }
+          if(!single)
+            (*values)[i].assign(buf.data() + locs[i]->offset - run.offset, locs[i]->len);
+          (*statuses)[i] = kSucc;
+        }
+      }
+    };
+
+    if(runs.size() <= MULTIGET_PARALLEL_RUNS) {
+      read_runs(0, runs.size());
+    } else {
+      // Even shares for the I/O threads, and one for us
+      size_t parts = io_workers.size() + 1;
+      size_t share = (runs.size() + parts - 1) / parts;
+      std::mutex mut;
+      std::condition_variable cv;
+      size_t outstanding = 0;
+      for(size_t from = share; from<runs.size(); from += share) {
+        size_t to = std::min(runs.size(), from + share);
+        {
+          std::lock_guard lock(mut);
+          ++outstanding;
+        }
+        submit([&, from, to]() {
+          read_runs(from, to);
+          std::lock_guard lock(mut);
+          if(--outstanding == 0) cv.notify_all();
+        });
+      }
+      read_runs(0, std::min(share, runs.size()));
+
+      std::unique_lock lock(mut);
+      cv.wait(lock, [&]() { return outstanding == 0; });
+    }
+
+    for(size_t i = 0; i<n; ++i)
+      if(gone[i]) (*statuses)[i] = Read(keys[i], &(*values)[i]);
+  }
+
+  /*
+   * NOTICE: Implement 'Range' in quarter-final,
+   *         you can skip it in preliminary.
+   */
+  // 5. Applies the given Vistor::Visit function to the result
+  // of every key-value pair in the key range [first, last),
+  // in order
+  // lower=="" is treated as a key before all keys in the database.
+  // upper=="" is treated as a key after all keys in the database.
+  // Therefore the following call will traverse the entire database:
+  //   Range("", "", visitor)
+  template<typename K>
+  RetCode EngineRace<K>::Range(const PolarString& lower, const PolarString& upper,
+      Visitor &visitor) {
+    // Values of sealed segments go to the visitor straight from the mapping
+    // The scan keeps its segments, so a value it cannot read is an I/O error
+    for(Scan it(*this, lower, upper); it.valid(); it.next()) {
+      PinnedValue value;
+      if(!it.value(&value)) return kIOError;
+      visitor.Visit(it.key(), value.value());
+    }
+
+    return kSucc;
+  }
+
+  template<typename K>
+  EngineRace<K>::Cursor::Cursor(EngineRace &engine, const PolarString &lower, const PolarString &upper)
+    : engine(engine), upper(upper.ToString()), snapshot(std::make_shared<Snapshot>()),
+      pending(pending_range(engine, snapshot, lower, upper)), it(engine.index, lower) {
+    pit = pending.begin();
+    settle();
+  }
+
+  template<typename K>
+  EngineRace<K>::Cursor::~Cursor() {
+    std::lock_guard lock(engine.snapshot_mut);
+    auto &open = engine.snapshots;
+    open.erase(std::find(open.begin(), open.end(), snapshot));
+  }
+
+  template<typename K>
+  std::map<typename K::key_type, IndexValue> EngineRace<K>::Cursor::pending_range(EngineRace &engine,
+      const std::shared_ptr<Snapshot> &snapshot, const PolarString &lower, const PolarString &upper) {
+    std::map<typename K::key_type, IndexValue> result;
+    auto journal_lock = engine.journal.shared_lock();
+
+    // Registered while the journal holds still, so the sync thread records
+    // pre-images for exactly the entries after it
+    snapshot->seq = engine.journal.data_seq();
+    {
+      std::lock_guard lock(engine.snapshot_mut);
+      engine.snapshots.push_back(snapshot);
+    }
+
+    for(auto data : { engine.journal.frozen_data(), engine.journal.data() }) {
+      for(const auto &pair : *data) {
+        PolarString key = pair.first;
+        if(key.compare(lower) >= 0 && (upper.size() == 0 || key.compare(upper) < 0))
+          result.insert_or_assign(pair.first, pair.second);
+      }
+    }
+    return result;
+  }
+
+  template<typename K>
+  bool EngineRace<K>::Cursor::below_upper(const PolarString &key) const {
+    return upper.size() == 0 || key.compare(upper) < 0;
+  }
+
+  // The location the index had for the key when the snapshot was taken.
+  // False if the key was not there yet
+  template<typename K>
+  bool EngineRace<K>::Cursor::visible(const PolarString &key, IndexValue &loc) {
+    std::lock_guard lock(snapshot->mut);
+    if(snapshot->before.empty()) return true;
+
+    auto found = snapshot->before.find(typename K::key_type(key));
+    if(found == snapshot->before.end()) return true;
+    if(!found->second) return false;
+    loc = *found->second;
+    return true;
+  }
+
+  // Merge the index with the newer journal entries
+  template<typename K>
+  void EngineRace<K>::Cursor::settle() {
+    while(true) {
+      bool in_index = it.valid() && below_upper(it.key());
+      done = !in_index && pit == pending.end();
+      if(done) return;
+
+      int cmp = !in_index ? -1 : pit == pending.end() ? 1 : K::compare(pit->first, it.key());
+      from_journal = cmp <= 0;
+      shadowed = cmp == 0;
+      if(from_journal) {
+        loc = pit->second;
+        return;
+      }
+
+      // The index cursor reads the index as it is now, not as it was
+      loc = it.value();
+      if(visible(it.key(), loc)) return;
+      it.next();
+    }
+  }
+
+  template<typename K>
+  bool EngineRace<K>::Cursor::valid() const {
+    return !done;
+  }
+
+  template<typename K>
+  PolarString EngineRace<K>::Cursor::key() const {
+    return from_journal ? PolarString(pit->first) : it.key();
+  }
+
+
+  template<typename K>
+  void EngineRace<K>::Cursor::next() {
+    if(from_journal) {
+      ++pit;
+      if(shadowed) it.next();
+    } else {
+      it.next();
+    }
+    settle();
+  }
+
+  template<typename K>
+  EngineRace<K>::Scan::Scan(EngineRace &engine, const PolarString &lower, const PolarString &upper)
+    : engine(engine), cursor(engine, lower, upper), cur(std::make_unique<Batch>()), ahead(std::make_unique<Batch>()) {
+    fill(*cur);
+    fill(*ahead);
+    wait(*cur);
+  }
+
+  template<typename K>
+  EngineRace<K>::Scan::~Scan() {
+    // The I/O threads write into it
+    wait(*ahead);
+  }
+
+  template<typename K>
+  bool EngineRace<K>::Scan::valid() const {
+    return pos < cur->keys.size();
+  }
+
+  template<typename K>
+  PolarString EngineRace<K>::Scan::key() const {
+    return cur->keys[pos];
+  }
+
+  template<typename K>
+  bool EngineRace<K>::Scan::value(PinnedValue *value) const {
+    if(!cur->ok[pos]) return false;
+    *value = cur->values[pos];
+    return true;
+  }
+
+  template<typename K>
+  void EngineRace<K>::Scan::next() {
+    if(++pos < cur->keys.size() || ahead->keys.empty()) return;
+
+    wait(*ahead);
+    std::swap(cur, ahead);
+    pos = 0;
+    fill(*ahead);
+  }
+
+  // Resolves the next batch of locations and queues their reads
+  template<typename K>
+  void EngineRace<K>::Scan::fill(Batch &batch) {
+    batch.keys.clear();
+    batch.locs.clear();
+    size_t bytes = 0;
+    for(; cursor.valid() && batch.keys.size() < RANGE_BATCH && bytes < RANGE_BATCH_BYTES; cursor.next()) {
+      batch.keys.push_back(cursor.key().ToString());
+      batch.locs.push_back(cursor.location());
+      bytes += cursor.location().len;
+    }
+
+    size_t n = batch.keys.size();
+    batch.values.assign(n, PinnedValue());
+    batch.ok.assign(n, false);
+    batch.order.resize(n);
+    for(size_t i = 0; i<n; ++i)
+      batch.order[i] = i;
+
+    // Scattered keys are mostly sequential reads within a segment
+    auto &locs = batch.locs;
+    std::sort(batch.order.begin(), batch.order.end(), [&](size_t a, size_t b) {
+      return std::make_pair(locs[a].file, locs[a].offset) < std::make_pair(locs[b].file, locs[b].offset);
+    });
+
+    for(size_t i = 0; i<n; ) {
+      const IndexValue &first = locs[batch.order[i]];
+      size_t end = first.offset + first.len;
+      if(first.is_inline()) break;
+      for(++i; i<n; ++i) {
+        const IndexValue &loc = locs[batch.order[i]];
+        if(loc.file != first.file || loc.offset > end + RANGE_ADVISE_GAP) break;
+        end = std::max(end, (size_t) (loc.offset + loc.len));
+      }
+      engine.tier(first).advise(first.file, first.offset, end - first.offset);
+    }
+
+    // Not worth a thread switch
+    if(n <= RANGE_FETCH_RUN) {
+      read_run(batch, 0, n);
+      return;
+    }
+
+    {
+      std::lock_guard lock(batch.mut);
+      batch.outstanding = (n + RANGE_FETCH_RUN - 1) / RANGE_FETCH_RUN;
+    }
+    for(size_t begin = 0; begin<n; begin += RANGE_FETCH_RUN) {
+      size_t end = std::min(n, begin + RANGE_FETCH_RUN);
+      engine.submit([this, &batch, begin, end]() {
+        this->read_run(batch, begin, end);
+
+        std::lock_guard lock(batch.mut);
+        if(--batch.outstanding == 0)
+          batch.cv.notify_all();
+      });
+    }
+  }
+
+  // The compactor keeps the segments a snapshot may still read
+  template<typename K>
+  void EngineRace<K>::Scan::read_run(Batch &batch, size_t begin, size_t end) {
+    for(size_t i = begin; i<end; ++i) {
+      size_t at = batch.order[i];
+      batch.ok[at] = engine.tier(batch.locs[at]).pin(batch.locs[at], &batch.values[at]);
+    }
+  }
+
+  template<typename K>
+  void EngineRace<K>::Scan::wait(Batch &batch) {
+    std::unique_lock lock(batch.mut);
+    batch.cv.wait(lock, [&]() { return batch.outstanding == 0; });
+  }
+
+  template<typename K>
+  void EngineRace<K>::submit(std::function<void()> task) {
+    {
+      std::lock_guard lock(io_mut);
+      io_tasks.push_back(std::move(task));
+    }
+    io_cv.notify_one();
+  }
+
+  // Scans finish their batches before the engine goes, so there is nothing
+  // left to run once halt is set
+  template<typename K>
+  void EngineRace<K>::io_worker() {
+    std::unique_lock lock(io_mut);
+    while(true) {
+      io_cv.wait(lock, [this]() { return this->halt || !io_tasks.empty(); });
+      if(io_tasks.empty()) return;
+
+      auto task = std::move(io_tasks.front());
+      io_tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::Open(const std::string& name, size_t count, Engine** eptr) {
+    std::experimental::filesystem::create_directory(name);
+    *eptr = NULL;
+
+    // A plain engine lives at the top of its directory
+    std::string path = name+"/"+SHARD_FILE;
+    if(!fs::exists(path)) {
+      if(fs::exists(name+"/"+INDEX_FILE)) return kInvalidArgument;
+
+      FILE *f = fopen(path.c_str(), "w");
+      if(!f) return kIOError;
+      bool ok = fprintf(f, "%zu\n", count) > 0 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+      fclose(f);
+      if(!ok) return kIOError;
+    }
+
+    size_t existing = 0;
+    FILE *f = fopen(path.c_str(), "r");
+    if(!f) return kIOError;
+    bool ok = fscanf(f, "%zu", &existing) == 1;
+    fclose(f);
+    if(!ok) return kCorruption;
+    if(existing != count) {
+      std::cout<<"Engine has "<<existing<<" shards, not "<<count<<std::endl;
+      return kInvalidArgument;
+    }
+
+    auto engine = std::make_unique<ShardedEngine>();
+    for(size_t i = 0; i<count; ++i) {
+      Engine *shard;
+      RetCode ret = EngineRace<K>::Open(name+"/"+std::to_string(i), &shard);
+      if(ret != kSucc) return ret;
+      engine->shards.emplace_back((EngineRace<K>*) shard);
+    }
+
+    *eptr = engine.release();
+    return kSucc;
+  }
+
+  // FNV-1a, the low bits of which spread well enough for a modulo
+  template<typename K>
+  EngineRace<K>& ShardedEngine<K>::shard(const PolarString& key) {
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i<key.size(); ++i) {
+      hash ^= (uint8_t) key[i];
+      hash *= 1099511628211ull;
+    }
+    return *shards[hash % shards.size()];
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::Write(const PolarString& key, const PolarString& value) {
+    return shard(key).Write(key, value);
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::Write(const WriteBatch& batch) {
+    if(batch.Count() == 0) return kSucc;
+
+    // Each shard commits on its own, so only a batch within one is atomic
+    EngineRace<K> &to = shard(batch.keys()[0]);
+    for(size_t i = 1; i<batch.Count(); ++i)
+      if(&shard(batch.keys()[i]) != &to) return kNotSupported;
+    return to.Write(batch);
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::Read(const PolarString& key, std::string* value) {
+    return shard(key).Read(key, value);
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::ReadPinned(const PolarString& key, PinnedValue* value) {
+    return shard(key).ReadPinned(key, value);
+  }
+
+  template<typename K>
+  void ShardedEngine<K>::MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values, std::vector<RetCode>* statuses) {
+    std::map<EngineRace<K>*, std::vector<size_t>> parts;
+    for(size_t i = 0; i<keys.size(); ++i)
+      parts[&shard(keys[i])].push_back(i);
+
+    values->assign(keys.size(), std::string());
+    statuses->resize(keys.size());
+    std::vector<PolarString> part_keys;
+    std::vector<std::string> part_values;
+    std::vector<RetCode> part_statuses;
+    for(auto &[s, at] : parts) {
+      part_keys.clear();
+      for(size_t i : at)
+        part_keys.push_back(keys[i]);
+
+      s->MultiGet(part_keys, &part_values, &part_statuses);
+      for(size_t j = 0; j<at.size(); ++j) {
+        (*values)[at[j]].swap(part_values[j]);
+        (*statuses)[at[j]] = part_statuses[j];
+      }
+    }
+  }
+
+  template<typename K>
+  RetCode ShardedEngine<K>::Range(const PolarString& lower, const PolarString& upper,
+      Visitor &visitor) {
+    typedef typename EngineRace<K>::Scan Scan;
+    std::vector<std::unique_ptr<Scan>> cursors;
+    for(auto &s : shards)
+      cursors.push_back(std::make_unique<Scan>(*s, lower, upper));
+
+    // Smallest key on top. Every key is in exactly one shard, so there are no ties
+    auto greater = [&](size_t a, size_t b) {
+      return K::compare(cursors[a]->key(), cursors[b]->key()) > 0;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for(size_t i = 0; i<cursors.size(); ++i)
+      if(cursors[i]->valid()) heap.push(i);
+
+    while(!heap.empty()) {
+      size_t i = heap.top();
+      heap.pop();
+
+      PinnedValue value;
+      if(!cursors[i]->value(&value)) return kIOError;
+      visitor.Visit(cursors[i]->key(), value.value());
+
+      cursors[i]->next();
+      if(cursors[i]->valid()) heap.push(i);
+    }
+
+    return kSucc;
+  }
+
+  template<typename K>
+  bool EngineRace<K>::clear_queue(typename Journal<K>::Queue *queue) {
+    if(queue->size() == 0) return true;
+
+    index.check_free_space();
+
+    // Scans that started before an entry still need what it replaces. Only
+    // this thread changes the index, so the lookup sees what the put replaces
+    std::vector<std::shared_ptr<Snapshot>> open;
+    {
+      std::lock_guard lock(snapshot_mut);
+      open = snapshots;
+    }
+
+    uint64_t seq = journal.frozen_seq();
+    for(auto &[k, v] : *queue) {
+      // Whatever was applied is replayed again on the next open
+      if(!index.has_room()) return false;
+      for(auto &snap : open) {
+        if(snap->seq >= seq) continue;
+        std::lock_guard lock(snap->mut);
+        if(snap->before.find(k) == snap->before.end())
+          snap->before.emplace(k, index.get(k));
+      }
+      auto old = index.lossy_put(k, v);
+      store.account(v, old);
+      blobs.account(v, old);
+      ++seq;
+    }
+
+    // Only this thread changes the index, readers do not need to wait for
+    // the msync
+    index.persist();
+    return true;
+  }
+
+  template<typename K>
+  void EngineRace<K>::load_live_bytes() {
+    // The index as of the counting snapshot. Entries applied since then are
+    // counted by the sync thread, and what they replaced is in the snapshot
+    for(typename Index<K>::Cursor it(index, ""); it.valid() && !halt; it.next()) {
+      std::optional<IndexValue> loc = it.value();
+      {
+        std::lock_guard lock(counting->mut);
+        auto found = counting->before.find(typename K::key_type(it.key()));
+        if(found != counting->before.end()) loc = found->second;
+      }
+      if(!loc) continue;
+      store.account(*loc, {});
+      blobs.account(*loc, {});
+    }
+
+    std::lock_guard lock(snapshot_mut);
+    snapshots.erase(std::find(snapshots.begin(), snapshots.end(), counting));
+    counted = !halt;
+  }
+
+  // Right after a checkpoint, so the index is persisted up to applied_seq
+  template<typename K>
+  void EngineRace<K>::save_manifest() {
+    StoreTail s = store.tail(), b = blobs.tail();
+    if(!manifest.save(s, b, journal.applied_seq())) return;
+    store.recorded(s);
+    blobs.recorded(b);
+  }
+
+  template<typename K>
+  CacheStats EngineRace<K>::cache_stats() {
+    return cache.stats();
+  }
+
+  template<typename K>
+  JournalStats EngineRace<K>::journal_stats() {
+    return journal.stats();
+  }
+
+  template<typename K>
+  IndexFlushStats EngineRace<K>::index_flush_stats() {
+    return index.flush_stats();
+  }
+
+  template<typename K>
+  CompactionStats EngineRace<K>::compaction_stats() {
+    std::lock_guard lock(compact_mut);
+    return stats;
+  }
+
+  template<typename K>
+  void EngineRace<K>::compact() {
+    compact(store);
+    if(!halt) compact(blobs);
+  }
+
+  // Blobs are copied forward within their own tier
+  template<typename K>
+  void EngineRace<K>::compact(Store &from) {
+    auto victims = from.victims(COMPACT_LIVE_RATIO, COMPACT_BATCH);
+    if(victims.empty()) return;
+
+    auto is_victim = [&](size_t file) {
+      return std::find(victims.begin(), victims.end(), file) != victims.end();
+    };
+
+    std::vector<typename Journal<K>::Entry> live;
+    for(typename Index<K>::Cursor it(index, ""); it.valid(); it.next())
+      if(is_victim(it.value().file))
+        live.emplace_back(it.key(), it.value());
+
+    // Copy the live values forward. A key written again in the meantime
+    // keeps its newer value, and the copy is left as garbage
+    auto start = std::chrono::steady_clock::now();
+    uint64_t copied = 0, relocated = 0;
+    std::string value;
+    for(const auto &[key, loc] : live) {
+      if(!from.fetch(loc, &value)) continue;
+
+      auto moved = from.append(PolarString(value));
+      if(!moved) continue;
+      bool ok = journal.push_if({ key, *moved }, loc, [&]() { return index.get(key); });
+      from.release(*moved);
+
+      copied += value.size();
+      if(ok) ++relocated;
+
+      // Stay under COMPACT_RATE
+      auto due = start + std::chrono::duration<double>((double) copied / COMPACT_RATE);
+      std::unique_lock lock(compact_mut);
+      if(compact_cv.wait_until(lock, due, [this]() { return this->halt.load(); }))
+        return;
+    }
+
+    // The journal synced each copy along with its entry, so it is on the
+    // disk before the only other copy goes. Wait until the index has the
+    // new locations
+    uint64_t target = journal.last_seq();
+    while(journal.applied_seq() < target) {
+      std::unique_lock lock(compact_mut);
+      if(compact_cv.wait_for(lock, SYNC_WAIT_TIMEOUT, [this]() { return this->halt.load(); }))
+        return;
+    }
+
+    // Scans that started before the copies may still read the old
+    // locations. The segments go in a later pass, once they are done
+    {
+      std::lock_guard lock(snapshot_mut);
+      for(auto &snap : snapshots)
+        if(snap->seq < target) victims.clear();
+    }
+
+    // Anything still pointing into a victim keeps it for the next pass
+    for(typename Index<K>::Cursor it(index, ""); it.valid(); it.next()) {
+      auto found = std::find(victims.begin(), victims.end(), it.value().file);
+      if(found != victims.end())
+        victims.erase(found);
+    }
+
+    uint64_t reclaimed = 0;
+    for(size_t file : victims) {
+      size_t size = from.drop(file);
+      reclaimed += size;
+      std::cout<<"Compacted "<<(file & BLOB_TIER ? "blob " : "")<<"segment "<<(file & ~BLOB_TIER)<<", reclaimed "<<size<<" bytes"<<std::endl;
+    }
+
+    std::lock_guard lock(compact_mut);
+    ++stats.passes;
+    stats.segments += victims.size();
+    stats.reclaimed += reclaimed;
+    stats.relocated += relocated;
+    stats.copied += copied;
+  }
+
+  template class Journal<VarKey>;
+  template class Journal<FixedKey<8>>;
+  template class Journal<FixedKey<16>>;
+  template class Index<VarKey>;
+  template class Index<FixedKey<8>>;
+  template class Index<FixedKey<16>>;
+  template class EngineRace<VarKey>;
+  template class EngineRace<FixedKey<8>>;
+  template class EngineRace<FixedKey<16>>;
+  template class ShardedEngine<VarKey>;
+  template class ShardedEngine<FixedKey<8>>;
+  template class ShardedEngine<FixedKey<16>>;
 }  // namespace polar_race
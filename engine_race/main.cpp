@@ -9,7 +9,7 @@ int main() {
   Engine *r;
 
   std::filesystem::create_directory("./test");
-  EngineRace::Open("test", &r);
+  Engine::Open("test", &r);
 
   while(true) {
     cout<<"> "<<flush;
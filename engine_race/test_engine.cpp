@@ -0,0 +1,591 @@
+// End to end checks of the engine: concurrent writes and reads against a
+// model, Read, MultiGet and Range, scans that keep their snapshot while
+// writes go on, WriteBatch, reopening, and recovery after the process is
+// killed in the middle of writing. Each runs on a plain EngineRace and on a
+// ShardedEngine of SHARDS partitions, with the key width the library was
+// built for.
+//
+//   make check, or make test_engine && engine_race/test_engine [keys]
+#include "engine_race.h"
+#include <algorithm>
+#include <random>
+#include <fstream>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace polar_race;
+using namespace std;
+
+static const string DIR = "test_engine.db";
+static const size_t SHARDS = 4;
+static const size_t THREADS = 8;
+static const size_t MISSING = 99999999; // Never written
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+  if(ok) return;
+  ++failures;
+  cout<<"FAIL: "<<what<<endl;
+}
+
+// Numbered keys that sort like their numbers, at the engine's key width
+static string key(size_t n) {
+  size_t width = DefaultKey::width > 0 ? DefaultKey::width : 12;
+  string digits = to_string(n);
+  string k = string(width - digits.size(), '0') + digits;
+  return DefaultKey::width > 0 ? k : "k" + k;
+}
+
+// Inline, store and blob sized values, telling apart each key and version
+static string value(size_t n, size_t version) {
+  string v = to_string(n) + "/" + to_string(version) + "/";
+  if(n % 3 == 0) v.resize(INLINE_MAX + 1 + n % 4000, 'x');
+  if(n % 251 == 0) v.resize(BLOB_MIN > 0 ? BLOB_MIN + n % 1000 : 300000, 'b');
+  return v;
+}
+
+// Engine logging goes to cout, keep it out of the results
+static Engine* open_engine(size_t shards) {
+  auto buf = cout.rdbuf(nullptr);
+  Engine *engine = nullptr;
+  RetCode ret = shards > 0 ? ShardedEngine<DefaultKey>::Open(DIR, shards, &engine)
+    : EngineRace<DefaultKey>::Open(DIR, &engine);
+  cout.rdbuf(buf);
+  cout.clear();
+  check(ret == kSucc, "open");
+  return engine;
+}
+
+static void close_engine(Engine *engine) {
+  auto buf = cout.rdbuf(nullptr);
+  delete engine;
+  cout.rdbuf(buf);
+  cout.clear();
+}
+
+struct Collect : Visitor {
+  vector<pair<string, string>> pairs;
+
+  void Visit(const PolarString &key, const PolarString &value) override {
+    pairs.emplace_back(key.ToString(), value.ToString());
+  }
+};
+
+static void check_range(Engine *engine, const map<string, string> &model, const string &lower, const string &upper) {
+  Collect got;
+  check(engine->Range(lower, upper, got) == kSucc, "range returns kSucc");
+
+  auto begin = model.lower_bound(lower);
+  auto end = upper.empty() ? model.end() : model.lower_bound(upper);
+  vector<pair<string, string>> want(begin, end);
+  check(got.pairs == want, "range [" + lower + ", " + upper + ") matches the model");
+}
+
+static void check_model(Engine *engine, const map<string, string> &model) {
+  size_t bad = 0;
+  for(const auto &[k, v] : model) {
+    string read;
+    PinnedValue pinned;
+    if(engine->Read(k, &read) != kSucc || read != v) ++bad;
+    if(engine->ReadPinned(k, &pinned) != kSucc || pinned.value() != PolarString(v)) ++bad;
+  }
+  check(bad == 0, "every key reads back its last value");
+
+  string read;
+  check(engine->Read(key(MISSING), &read) == kNotFound, "a missing key is not found");
+
+  vector<PolarString> keys;
+  for(const auto &[k, v] : model)
+    if(keys.size() < 1000) keys.push_back(k);
+  keys.push_back(key(MISSING));
+  vector<string> values;
+  vector<RetCode> statuses;
+  engine->MultiGet(keys, &values, &statuses);
+  bool ok = statuses.back() == kNotFound;
+  for(size_t i = 0; i + 1<keys.size(); ++i)
+    ok = ok && statuses[i] == kSucc && values[i] == model.at(keys[i].ToString());
+  check(ok, "MultiGet matches the model");
+
+  check_range(engine, model, "", "");
+  if(model.size() > 3) {
+    auto lower = next(model.begin(), model.size() / 3)->first;
+    auto upper = next(model.begin(), model.size() / 2)->first;
+    check_range(engine, model, lower, upper);
+  }
+}
+
+// Shards commit on their own, so a batch across them is refused as a whole.
+// There the keys go in as batches of one instead
+static void write_batch(Engine *engine, size_t shards, const WriteBatch &batch, const string &what) {
+  if(shards == 0) {
+    check(engine->Write(batch) == kSucc, what);
+    return;
+  }
+
+  string read;
+  check(engine->Write(batch) == kNotSupported && engine->Read(batch.keys()[0], &read) == kNotFound,
+      what + " across shards is refused");
+  bool ok = true;
+  for(size_t i = 0; i<batch.Count(); ++i) {
+    WriteBatch one;
+    one.Put(batch.keys()[i], batch.values()[i]);
+    ok = ok && engine->Write(one) == kSucc;
+  }
+  check(ok, what + " by single keys");
+}
+
+// Threads write disjoint keys, some of them twice, and read each one back
+static void test_writes(size_t shards, size_t keys, map<string, string> &model) {
+  Engine *engine = open_engine(shards);
+  vector<thread> threads;
+  mutex mut;
+  atomic<size_t> bad = 0;
+  for(size_t t = 0; t<THREADS; ++t) {
+    threads.emplace_back([&, t]() {
+      for(size_t n = t; n<keys; n += THREADS) {
+        for(size_t version = 0; version < 1 + (n % 5 == 0); ++version) {
+          string k = key(n), v = value(n, version), read;
+          if(engine->Write(k, v) != kSucc) ++bad;
+          if(engine->Read(k, &read) != kSucc || read != v) ++bad;
+          lock_guard lock(mut);
+          model[k] = v;
+        }
+      }
+    });
+  }
+  for(auto &t : threads)
+    t.join();
+  check(bad == 0, "writes succeed and read back");
+
+  // A batch puts several keys at once, the last value of a repeated key wins
+  WriteBatch batch;
+  for(size_t n = keys; n<keys + 100; ++n) {
+    batch.Put(key(n), value(n, 0));
+    model[key(n)] = value(n, 0);
+  }
+  batch.Put(key(keys), value(keys, 1));
+  model[key(keys)] = value(keys, 1);
+  write_batch(engine, shards, batch, "batch write");
+
+  // More than a segment of values, so the batch spans segments
+  WriteBatch large;
+  for(size_t n = keys + 101; n<keys + 161; ++n) {
+    string v(200000, 'a' + n % 26);
+    large.Put(key(n), v);
+    model[key(n)] = v;
+  }
+  write_batch(engine, shards, large, "batch larger than a segment");
+
+  // Larger than any segment, it used to roll over to new ones forever
+  check(engine->Write(key(keys + 100), string(70 << 20, 'o')) == kInvalidArgument, "a value larger than a segment is refused");
+  check(engine->Write(key(keys + 100), string(MAX_VAL_LEN + 1, 'o')) == kInvalidArgument, "a value over MAX_VAL_LEN is refused");
+
+  check_model(engine, model);
+  close_engine(engine);
+}
+
+static void test_reopen(size_t shards, const map<string, string> &model) {
+  Engine *engine = open_engine(shards);
+  check_model(engine, model);
+  close_engine(engine);
+}
+
+// One writer keeps counting through the values of a fixed set of keys. A
+// scan sees all of them as of a single moment, so its values are a run of
+// consecutive counts. Shards take their snapshots one after the other, so
+// there each key only has to be there once, in order
+static void test_snapshots(size_t shards, size_t keys) {
+  fs::remove_all(DIR);
+  Engine *engine = open_engine(shards);
+  for(size_t n = 0; n<keys; ++n)
+    engine->Write(key(n), to_string(n));
+
+  atomic<bool> stop = false;
+  thread writer([&]() {
+    for(size_t count = keys; !stop; ++count)
+      engine->Write(key(count % keys), to_string(count));
+  });
+
+  for(size_t round = 0; round<10; ++round) {
+    this_thread::sleep_for(50ms);
+    Collect got;
+    engine->Range("", "", got);
+
+    bool ok = got.pairs.size() == keys;
+    for(size_t i = 0; ok && i<keys; ++i)
+      ok = got.pairs[i].first == key(i);
+    if(shards == 0 && ok) {
+      vector<size_t> counts;
+      for(const auto &[k, v] : got.pairs)
+        counts.push_back(stoul(v));
+      sort(counts.begin(), counts.end());
+      ok = counts.back() - counts.front() == keys - 1;
+    }
+    check(ok, "scan " + to_string(round) + " sees one point in time");
+  }
+
+  stop = true;
+  writer.join();
+  close_engine(engine);
+}
+
+// A child writes numbered keys and tells the parent each one that was
+// acknowledged, until the parent kills it. Everything acknowledged has to
+// be there after reopening, and nothing past what was written
+static void test_crash(size_t shards, bool batches) {
+  fs::remove_all(DIR);
+  mt19937 rng(shards * 2 + batches);
+  size_t acked = 0;
+  for(size_t round = 0; round<5; ++round) {
+    int fds[2];
+    if(pipe(fds) != 0) {
+      check(false, "pipe");
+      return;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0) {
+      ::close(fds[0]);
+      Engine *engine = open_engine(shards);
+      for(uint64_t n = acked; ; ++n) {
+        RetCode ret;
+        if(batches) {
+          WriteBatch batch;
+          batch.Put(key(n), value(n, round));
+          ret = engine->Write(batch);
+        } else {
+          ret = engine->Write(key(n), value(n, round));
+        }
+        if(ret != kSucc || write(fds[1], &n, sizeof(n)) != sizeof(n)) _exit(1);
+      }
+    }
+
+    ::close(fds[1]);
+    this_thread::sleep_for(chrono::milliseconds(100 + rng() % 200));
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    uint64_t n;
+    size_t written = acked;
+    while(read(fds[0], &n, sizeof(n)) == sizeof(n))
+      written = n + 1;
+    ::close(fds[0]);
+
+    Engine *engine = open_engine(shards);
+    size_t bad = 0;
+    for(size_t i = acked; i<written; ++i) {
+      string read;
+      if(engine->Read(key(i), &read) != kSucc || read != value(i, round)) ++bad;
+    }
+    // At most the one write in flight made it without being acknowledged
+    string read;
+    bool extra = engine->Read(key(written + 1), &read) == kSucc;
+    close_engine(engine);
+
+    check(written > acked, "crash round " + to_string(round) + " wrote something");
+    check(bad == 0 && !extra, "crash round " + to_string(round) + " keeps exactly what was acknowledged");
+    acked = written;
+  }
+}
+
+// Store values overwritten until the first segments are mostly dead. Once
+// the compactor dropped some, the survivors it copied forward still match
+static void test_compaction() {
+  fs::remove_all(DIR);
+  Engine *engine = open_engine(0);
+  // The compactor logs what it drops
+  auto buf = cout.rdbuf(nullptr);
+  const size_t keys = 3000, rounds = 4;
+  map<string, string> model;
+  bool ok = true;
+  for(size_t round = 0; round < rounds; ++round) {
+    for(size_t n = 0; n<keys; ++n) {
+      // Every eighth key keeps its first value, in the oldest segments
+      if(round > 0 && n % 8 == 0) continue;
+      string v = value(n, round);
+      v.resize(INLINE_MAX + 4000, 'c');
+      ok = ok && engine->Write(key(n), v) == kSucc;
+      model[key(n)] = v;
+    }
+  }
+
+  auto stats = [&]() { return static_cast<EngineRace<DefaultKey>*>(engine)->compaction_stats(); };
+  auto until = chrono::steady_clock::now() + 60s;
+  while(stats().segments == 0 && chrono::steady_clock::now() < until)
+    this_thread::sleep_for(100ms);
+  cout.rdbuf(buf);
+  cout.clear();
+  check(ok, "overwrites");
+  check(stats().segments > 0 && stats().relocated > 0, "mostly dead segments are compacted");
+  check_model(engine, model);
+  close_engine(engine);
+
+  engine = open_engine(0);
+  check_model(engine, model);
+  close_engine(engine);
+}
+
+// Open refuses an index or journal in another format, and leaves it as it
+// was. An index it cannot map is an I/O error
+static void test_foreign_files() {
+  auto open_with = [](const string &file, const string &contents) {
+    fs::remove_all(DIR);
+    fs::create_directory(DIR);
+    if(contents.empty()) {
+      fs::create_directory(DIR + "/" + file);
+    } else {
+      FILE *f = fopen((DIR + "/" + file).c_str(), "w");
+      fwrite(contents.data(), 1, contents.size(), f);
+      fclose(f);
+    }
+
+    auto buf = cout.rdbuf(nullptr);
+    Engine *engine = nullptr;
+    RetCode ret = EngineRace<DefaultKey>::Open(DIR, &engine);
+    cout.rdbuf(buf);
+    cout.clear();
+    delete engine;
+    return ret;
+  };
+  auto unchanged = [](const string &file, const string &contents) {
+    ifstream in(DIR + "/" + file, ios::binary);
+    return string(istreambuf_iterator<char>(in), {}) == contents;
+  };
+
+  string foreign(10000, 'f');
+  check(open_with(INDEX_FILE, foreign) == kCorruption && unchanged(INDEX_FILE, foreign),
+      "an index in another format is refused");
+  check(open_with(JOURNAL_FILE, foreign) == kCorruption && unchanged(JOURNAL_FILE, foreign),
+      "a journal in another format is refused");
+  check(open_with(INDEX_FILE, "") == kIOError, "an index that cannot be opened");
+}
+
+// Hands out its pairs in order
+struct Pairs : BulkSource {
+  vector<pair<string, string>> pairs;
+  size_t at = 0;
+
+  bool Next(PolarString *key, PolarString *value) override {
+    if(at == pairs.size()) return false;
+    *key = pairs[at].first;
+    *value = pairs[at].second;
+    ++at;
+    return true;
+  }
+};
+
+static size_t count_range(Engine *engine) {
+  Collect all;
+  engine->Range("", "", all);
+  return all.pairs.size();
+}
+
+// Bad input leaves the index empty, even after whole chunks went in, and a
+// good load after it has inline, store and blob values. Only an empty
+// engine takes one
+static void test_bulk_load() {
+  fs::remove_all(DIR);
+  Engine *engine = open_engine(0);
+  size_t keys = 3 * BULK_CHUNK + 100;
+
+  Pairs unsorted;
+  unsorted.pairs = { { key(2), value(2, 0) }, { key(1), value(1, 0) } };
+  check(engine->BulkLoad(unsorted) == kInvalidArgument && count_range(engine) == 0,
+      "an unsorted bulk load is refused");
+
+  // Past two chunks, then a key out of order
+  Pairs aborted;
+  for(size_t n = 0; n < 2 * BULK_CHUNK + 10; ++n)
+    aborted.pairs.emplace_back(key(n), value(n, 0));
+  aborted.pairs.emplace_back(key(0), value(0, 0));
+  string read;
+  check(engine->BulkLoad(aborted) == kInvalidArgument && count_range(engine) == 0
+      && engine->Read(key(0), &read) == kNotFound, "an aborted bulk load leaves nothing");
+
+  Pairs good;
+  map<string, string> model;
+  for(size_t n = 0; n<keys; ++n) {
+    good.pairs.emplace_back(key(n), value(n, 1));
+    model[key(n)] = value(n, 1);
+  }
+  check(engine->BulkLoad(good) == kSucc, "a bulk load after an aborted one");
+  check_model(engine, model);
+
+  Pairs more;
+  more.pairs = { { key(keys), value(keys, 0) } };
+  check(engine->BulkLoad(more) == kInvalidArgument && engine->Read(key(keys), &read) == kNotFound,
+      "a bulk load into a non-empty engine is refused");
+  close_engine(engine);
+
+  engine = open_engine(0);
+  check_model(engine, model);
+  close_engine(engine);
+}
+
+// A value that could not be written is refused, and not journaled. The
+// child runs into a file size limit once it has opened the engine
+static void test_write_errors() {
+  fs::remove_all(DIR);
+  pid_t pid = fork();
+  if(pid == 0) {
+    Engine *engine = open_engine(0);
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit { 1 << 20, 1 << 20 };
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    // Below BLOB_MIN, so it goes to a regular segment
+    string large(200000, 'v');
+    RetCode ret = kSucc;
+    size_t n = 0;
+    while(ret == kSucc && n < 20)
+      ret = engine->Write(key(n++), large);
+
+    // Past the limit, only a value kept inline can still be written
+    string read, small = "small";
+    bool inlined = small.size() <= INLINE_MAX;
+    bool ok = ret == kIOError && engine->Read(key(n - 1), &read) == kNotFound
+      && (!inlined || engine->Write(key(n), small) == kSucc);
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "a value that cannot be written is refused");
+}
+
+// A write the journal fails to flush is refused, and is not found then or
+// after reopening. The child's limit stops the journal within its ring
+static void test_journal_errors() {
+  fs::remove_all(DIR);
+  int fds[2];
+  check(pipe(fds) == 0, "pipe");
+  pid_t pid = fork();
+  if(pid == 0) {
+    Engine *engine = open_engine(0);
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit { 256 << 10, 256 << 10 };
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    string v(INLINE_MAX > 0 ? min(INLINE_MAX, (size_t) 100) : 100, 'j');
+    RetCode ret = kSucc;
+    size_t n = 0;
+    while(n < 200000 && (ret = engine->Write(key(n), v)) == kSucc)
+      ++n;
+
+    string read;
+    bool ok = ret == kIOError && engine->Read(key(n), &read) == kNotFound;
+    close_engine(engine);
+    ok = ok && write(fds[1], &n, sizeof(n)) == sizeof(n);
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  close(fds[1]);
+  size_t n = 0;
+  bool sent = read(fds[0], &n, sizeof(n)) == sizeof(n);
+  close(fds[0]);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0 && sent, "a write the journal cannot flush is refused");
+  if(!sent) return;
+
+  Engine *engine = open_engine(0);
+  string read;
+  check(engine->Read(key(n), &read) == kNotFound, "a refused write is gone after reopening");
+  Collect all;
+  check(engine->Range("", "", all) == kSucc && all.pairs.size() == n, "acknowledged writes survive reopening");
+  close_engine(engine);
+}
+
+// Once the index cannot grow, the sync thread stops applying and writes are
+// refused, while everything acknowledged stays readable. The child's limit
+// lets the journal, the segments and the first index chunk be, but not the
+// next one. Inline values fill the index fastest, if the build has them
+static void test_index_full() {
+  const size_t most = 2000000;
+  fs::remove_all(DIR);
+  pid_t pid = fork();
+  if(pid == 0) {
+    Engine *engine = open_engine(0);
+    cout.rdbuf(nullptr);
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit { 17 << 20, 17 << 20 };
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    string v(INLINE_MAX > 0 ? min(INLINE_MAX, (size_t) 1000) : 1, 'f');
+    vector<thread> threads;
+    vector<size_t> written(THREADS);
+    atomic<bool> refused = false;
+    for(size_t t = 0; t<THREADS; ++t) {
+      threads.emplace_back([&, t]() {
+        // Keys t, t + THREADS, ... up to the first that is refused
+        for(size_t n = t; n<most && !refused; n += THREADS, ++written[t]) {
+          if(engine->Write(key(n), v) != kSucc) {
+            refused = true;
+            break;
+          }
+        }
+      });
+    }
+    for(auto &t : threads)
+      t.join();
+
+    bool ok = refused && engine->Write(key(most), v) == kIOError;
+    string read;
+    for(size_t t = 0; ok && t<THREADS; ++t)
+      for(size_t i = 0, n = t; ok && i<written[t]; ++i, n += THREADS)
+        ok = engine->Read(key(n), &read) == kSucc && read == v;
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "writes stop once the index cannot grow");
+}
+
+int main(int argc, char **argv) {
+  size_t keys = argc > 1 ? stoul(argv[1]) : 20000;
+
+  for(size_t shards : { (size_t) 0, SHARDS }) {
+    string name = shards > 0 ? to_string(shards) + " shards" : "plain";
+    int before = failures;
+
+    fs::remove_all(DIR);
+    map<string, string> model;
+    test_writes(shards, keys, model);
+    test_reopen(shards, model);
+    test_snapshots(shards, min(keys, (size_t) 5000));
+    test_crash(shards, false);
+    test_crash(shards, true);
+
+    cout<<name<<": "<<(failures == before ? "ok" : "FAILED")<<endl;
+  }
+
+  int before = failures;
+  test_foreign_files();
+  cout<<"foreign files: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  before = failures;
+  test_compaction();
+  cout<<"compaction: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  before = failures;
+  test_bulk_load();
+  cout<<"bulk load: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  before = failures;
+  test_write_errors();
+  cout<<"write errors: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  before = failures;
+  test_journal_errors();
+  cout<<"journal errors: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  before = failures;
+  test_index_full();
+  cout<<"index full: "<<(failures == before ? "ok" : "FAILED")<<endl;
+
+  fs::remove_all(DIR);
+  return failures == 0 ? 0 : 1;
+}
@@ -2,6 +2,8 @@
 #ifndef INCLUDE_ENGINE_H_
 #define INCLUDE_ENGINE_H_
 #include <string>
+#include <memory>
+#include <vector>
 #include "polar_string.h"
 
 namespace polar_race {
@@ -27,6 +29,64 @@ class Visitor {
   virtual void Visit(const PolarString &key, const PolarString &value) = 0;
 };
 
+// Filled by Engine::ReadPinned. value() may point straight into the
+// engine's storage, and stays valid until Reset() or destruction
+class PinnedValue {
+ public:
+  PinnedValue() { }
+
+  const PolarString& value() const { return value_; }
+
+  void Pin(const PolarString& value, std::shared_ptr<const void> holder) {
+    value_ = value;
+    holder_ = std::move(holder);
+  }
+
+  void Reset() {
+    value_.clear();
+    holder_.reset();
+  }
+
+ private:
+  PolarString value_;
+  std::shared_ptr<const void> holder_;
+};
+
+// Pass to Engine::Write to write several pairs at once. A key put twice
+// ends up with the later value
+class WriteBatch {
+ public:
+  WriteBatch() { }
+
+  void Put(const PolarString& key, const PolarString& value) {
+    keys_.push_back(key.ToString());
+    values_.push_back(value.ToString());
+  }
+
+  void Clear() {
+    keys_.clear();
+    values_.clear();
+  }
+
+  size_t Count() const { return keys_.size(); }
+  const std::vector<std::string>& keys() const { return keys_; }
+  const std::vector<std::string>& values() const { return values_; }
+
+ private:
+  std::vector<std::string> keys_;
+  std::vector<std::string> values_;
+};
+
+// Pass to Engine::BulkLoad. Next gives the following pair, in strictly
+// increasing key order, and returns false after the last one. key and
+// value only need to stay valid until the next call
+class BulkSource {
+ public:
+  virtual ~BulkSource() {}
+
+  virtual bool Next(PolarString* key, PolarString* value) = 0;
+};
+
 class Engine {
  public:
   // Open engine
@@ -42,10 +102,32 @@ class Engine {
   virtual RetCode Write(const PolarString& key,
       const PolarString& value) = 0;
 
+  // Write all pairs of the batch. After a crash either all of them
+  // are there or none. The default implementation is kNotSupported
+  virtual RetCode Write(const WriteBatch& batch);
+
   // Read value of a key
   virtual RetCode Read(const PolarString& key,
       std::string* value) = 0;
 
+  // Read value of a key without copying it out of the engine
+  // when possible. The default implementation pins a copy
+  virtual RetCode ReadPinned(const PolarString& key,
+      PinnedValue* value);
+
+  // Read the values of several keys at once. statuses gets what Read
+  // would have returned for each key. The default implementation calls
+  // Read for each of them
+  virtual void MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values,
+      std::vector<RetCode>* statuses);
+
+  // Load the pairs of source into an empty engine, which nothing else
+  // writes to meanwhile. They become visible all at once when it returns
+  // kSucc, and not at all otherwise. kInvalidArgument if the engine is
+  // not empty or the keys are not sorted. The default implementation is
+  // kNotSupported
+  virtual RetCode BulkLoad(BulkSource& source);
 
   /*
    * NOTICE: Implement 'Range' in quarter-final,